@@ -1,6 +1,4 @@
 
-#include <fstream>
-
 #include "parser.hh"
 #include "ast.hh"
 
@@ -39,6 +37,9 @@ struct TVisitor : IVisitor {
   }
 
   bool IsEps(const TNode* n) {
+    if (n == nullptr) {
+      return true;  // elided by --elide_eps
+    }
     auto t = dynamic_cast<const TTree*>(n);
     if (t == nullptr) {
       return false;
@@ -110,8 +111,15 @@ struct TVisitor : IVisitor {
     }
   }
 
+  // NUM has `%value NUM int`, the lexer has already converted it
   void visit_f_num(TTree* ctx) override {
-    ctx->value = std::stoi(ctx->children[0]->name);
+    ctx->value = ctx->children[0]->value;
+  }
+
+  void visit_f_num_batch(const std::vector<TTree*>& nodes) override {
+    for (auto node : nodes) {
+      node->value = node->children[0]->value;
+    }
   }
 
   void visit_f_num_after(TTree* ctx) override {
@@ -157,21 +165,5 @@ std::shared_ptr<IVisitor> GetVisitor() {
 }
 
 int main(int argc, char** argv) {
-  std::shared_ptr<std::istream> source;
-  if (argc == 1) {
-    // read from stdin
-    source = std::shared_ptr<std::istream>(&std::cin, [](auto) {});
-    // custom noop deleter for std::cin
-  } else {
-    assert(argc == 2);
-    source = std::make_shared<std::ifstream>(std::string{argv[1]});
-  }
-  auto lexer = std::make_shared<TLexer>(source);
-  auto parser = std::make_shared<TParser>(lexer);
-
-  auto result = parser->Parse();
-  TreeToDot(std::cout, result.get());
-  std::cerr << "The answer has value: " << result->value.has_value() << std::endl;
-  std::cerr << "The answer has type: " << result->value.type().name() << std::endl;
-  std::cerr << "The answer is " << std::any_cast<TVisitor::T>(result->value) << std::endl;
+  return RunDriver(argc, argv, [](std::ostream& out, const std::any& value) { out << std::any_cast<TVisitor::T>(value); });
 }
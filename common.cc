@@ -1,3 +1,4 @@
+#include <cctype>
 #include <regex>
 
 #include <absl/strings/str_split.h>
@@ -17,6 +18,487 @@
 
 #include "common.hh"
 
+// Splits the right hand side of a rule into symbols and EBNF operators
+std::vector<std::string> TokenizeProductions(std::string_view ps) {
+  std::vector<std::string> result;
+  std::string current;
+  for (char c : ps) {
+    const bool isOperator = std::string_view{"()*+?|"}.find(c) != std::string_view::npos;
+    if (std::isspace(static_cast<unsigned char>(c)) || isOperator) {
+      if (!current.empty()) {
+        result.push_back(std::move(current));
+        current.clear();
+      }
+      if (isOperator) {
+        result.emplace_back(1, c);
+      }
+    } else {
+      current += c;
+    }
+  }
+  if (!current.empty()) {
+    result.push_back(std::move(current));
+  }
+  return result;
+}
+
+bool IsEbnfSuffix(const std::string& tok) {
+  return tok == "*" || tok == "+" || tok == "?";
+}
+
+// Recursive descent over the EBNF of a single rule:
+//   alternatives := sequence ('|' sequence)*
+//   sequence     := item+
+//   item         := (SYMBOL | '(' alternatives ')') ('*' | '+' | '?')?
+struct TProductionParser {
+  TGrammar& grammar;
+  const std::string& lhs;
+  std::vector<std::string> toks;
+  std::size_t pos{0};
+
+  std::vector<std::vector<std::string>> ParseAlternatives() {
+    std::vector<std::vector<std::string>> alternatives{ParseSequence()};
+    while (pos < toks.size() && toks[pos] == "|") {
+      pos++;
+      alternatives.push_back(ParseSequence());
+    }
+    return alternatives;
+  }
+
+  std::vector<std::string> ParseSequence() {
+    std::vector<std::string> sequence;
+    while (pos < toks.size() && toks[pos] != "|" && toks[pos] != ")") {
+      sequence.push_back(ParseItem());
+    }
+    EXPECT(!sequence.empty(), "Empty productions are prohibited");
+    return sequence;
+  }
+
+  std::string ParseItem() {
+    std::vector<std::vector<std::string>> group;
+    const bool isGroup = toks[pos] == "(";
+    if (isGroup) {
+      pos++;
+      group = ParseAlternatives();
+      EXPECT(pos < toks.size() && toks[pos] == ")", absl::StrFormat("Unbalanced parentheses in the rule for `%s`", lhs));
+      pos++;
+    } else {
+      EXPECT(!IsEbnfSuffix(toks[pos]), absl::StrFormat("Dangling `%s` in the rule for `%s`", toks[pos], lhs));
+      group = {{toks[pos++]}};
+    }
+
+    const char op = pos < toks.size() && IsEbnfSuffix(toks[pos]) ? toks[pos++][0] : '\0';
+    switch (op) {
+      case '?':
+        group.push_back({"EPS"});
+        return AddSynthetic(ESynthetic::Optional, "opt", std::move(group));
+      case '*':
+        return AddStar(std::move(group));
+      case '+': {
+        auto star = AddStar(group);
+        for (auto& rhs : group) {
+          rhs.push_back(star);
+        }
+        return AddSynthetic(ESynthetic::Group, "plus", std::move(group));
+      }
+      default:
+        return isGroup ? AddSynthetic(ESynthetic::Group, "group", std::move(group)) : group.front().front();
+    }
+  }
+
+  std::string AddStar(std::vector<std::vector<std::string>> group) {
+    auto name = SyntheticName("star");
+    for (auto& rhs : group) {
+      rhs.push_back(name);
+    }
+    group.push_back({"EPS"});
+    grammar.synthetic[name] = {ESynthetic::Star, lhs};
+    grammar.rules[name] = std::move(group);
+    return name;
+  }
+
+  std::string AddSynthetic(ESynthetic kind, std::string_view kindName, std::vector<std::vector<std::string>> group) {
+    auto name = SyntheticName(kindName);
+    grammar.synthetic[name] = {kind, lhs};
+    grammar.rules[name] = std::move(group);
+    return name;
+  }
+
+  std::string SyntheticName(std::string_view kindName) {
+    auto name = absl::StrFormat("%s__%s%d", lhs, kindName, grammar.synthetic.size() + 1);
+    EXPECT(grammar.rules.count(name) == 0, absl::StrFormat("Nonterminal `%s` clashes with a generated one", name));
+    return name;
+  }
+};
+
+// Directives are the statements of the rules section that start with '%'
+// %value kinds and the types they convert to
+const std::unordered_map<std::string, std::string> TOKEN_VALUE_TYPES = {
+  {"int", "int"},
+  {"int64", "std::int64_t"},
+  {"uint64", "std::uint64_t"},
+  {"float", "double"},
+  {"intern", "TSymbol"},  // an id in a TSymbolTable
+};
+
+void ParseDirective(TGrammar& grammar, std::string_view directive) {
+  std::vector<std::string> words = absl::StrSplit(directive, absl::ByAnyChar(" \t\n"), absl::SkipWhitespace());
+  const auto& name = words.front();
+  if (name == "%split") {
+    EXPECT(words.size() == 2, "Expected `%split SEPARATOR`");
+    EXPECT(grammar.tokenToRegex.contains(words[1]), absl::StrFormat("Unknown %%split separator `%s`", words[1]));
+    EXPECT(!grammar.split.has_value(), "Only one %split is allowed");
+    grammar.split = TSplit{"", words[1]};
+  } else if (name == "%value") {
+    EXPECT(words.size() == 3, "Expected `%value TOKEN kind`");
+    EXPECT(grammar.tokenToRegex.contains(words[1]), absl::StrFormat("Unknown %%value token `%s`", words[1]));
+    auto it = TOKEN_VALUE_TYPES.find(words[2]);
+    EXPECT(it != TOKEN_VALUE_TYPES.end(), absl::StrFormat("Unknown %%value kind `%s`", words[2]));
+    EXPECT(grammar.tokenValue.emplace(words[1], it->second).second, absl::StrFormat("Duplicate %%value for %s", words[1]));
+  } else if (name == "%pure") {
+    EXPECT(words.size() >= 2, "Expected `%pure $symbol...`");
+    for (const auto& symbol : words | ranges::views::drop(1)) {
+      EXPECT(IS_TS(symbol), absl::StrFormat("%%pure expects translation symbols, got `%s`", symbol));
+      grammar.pure.insert(symbol);
+    }
+  } else if (name == "%batch") {
+    EXPECT(words.size() >= 2, "Expected `%batch $symbol...`");
+    for (const auto& symbol : words | ranges::views::drop(1)) {
+      EXPECT(IS_TS(symbol), absl::StrFormat("%%batch expects translation symbols, got `%s`", symbol));
+      grammar.batch.insert(symbol);
+    }
+  } else if (name == "%depends") {
+    EXPECT(words.size() >= 2 && IS_TS(words[1]), "Expected `%depends $symbol [parent] [nonterminal...]`");
+    EXPECT(!grammar.depends.contains(words[1]), absl::StrFormat("Duplicate %%depends for %s", words[1]));
+    auto& deps = grammar.depends[words[1]];
+    for (const auto& dep : words | ranges::views::drop(2)) {
+      EXPECT(IS_NTERM(dep), absl::StrFormat("%s can only depend on parent or a nonterminal, not on `%s`", words[1], dep));
+      deps.push_back(dep);
+    }
+  } else {
+    EXPECT(false, absl::StrFormat("Unknown directive `%s`", name));
+  }
+}
+
+void CheckSplit(TGrammar& grammar) {
+  auto& [item, separator] = *grammar.split;
+  constexpr auto SHAPE = "%split needs the rule `start: item ( SEPARATOR item )*;`";
+  EXPECT(grammar.rules.contains("start") && grammar.rules.at("start").size() == 1, SHAPE);
+  const auto& rhs = grammar.rules.at("start").front();
+  EXPECT(rhs.size() == 2 && IS_NTERM(rhs[0]) && !grammar.synthetic.contains(rhs[0]), SHAPE);
+  const auto& star = rhs[1];
+  const std::vector<std::vector<std::string>> starRules{{separator, rhs[0], star}, {"EPS"}};
+  EXPECT(grammar.synthetic.contains(star) && grammar.rules.at(star) == starRules, SHAPE);
+  item = rhs[0];
+
+  // The items are parsed before start has any children, so their actions
+  // mustn't read it. They need %depends to say what they read then: start has
+  // no actions, so CheckDepends rejects depending on it as the parent.
+  std::unordered_set<std::string> seen{item};
+  std::vector<std::string> stack{item};
+  while (!stack.empty()) {
+    auto nterm = std::move(stack.back());
+    stack.pop_back();
+    if (!grammar.rules.contains(nterm)) {
+      continue;
+    }
+    for (const auto& itemRhs : grammar.rules.at(nterm)) {
+      for (const auto& s : itemRhs) {
+        EXPECT(s != separator, absl::StrFormat("%%split separator %s occurs inside %s (in the rule for %s)", separator, item, nterm));
+        EXPECT(!IS_TS(s) || grammar.depends.contains(s),
+            absl::StrFormat("%%split needs %%depends for %s, to tell it doesn't read start", s));
+        if (IS_NTERM(s) && seen.insert(s).second) {
+          stack.push_back(s);
+        }
+      }
+    }
+  }
+}
+
+void CheckPure(const TGrammar& grammar) {
+  std::unordered_set<std::string> used;
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      for (std::size_t i = 0; i < rhs.size(); i++) {
+        if (!grammar.pure.contains(rhs[i])) {
+          continue;
+        }
+        used.insert(rhs[i]);
+        EXPECT(!grammar.synthetic.contains(lhs), absl::StrFormat("%%pure %s can't be inside a group of the rule for %s", rhs[i], grammar.synthetic.at(lhs).owner));
+        EXPECT(i + 1 == rhs.size(), absl::StrFormat("%%pure %s has to be the last symbol in the rule for %s", rhs[i], lhs));
+      }
+    }
+  }
+  for (const auto& symbol : grammar.pure) {
+    EXPECT(used.contains(symbol), absl::StrFormat("%%pure %s isn't used in any rule", symbol));
+  }
+
+  // Nonterminals whose value a %pure action sets, i.e. maybe only after the
+  // parse, and groups with one of them inside (groups are parsed into the
+  // node of their owner), each mapped to such a nonterminal
+  std::unordered_map<std::string, std::string> deferred;
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      if (!rhs.empty() && grammar.pure.contains(rhs.back())) {
+        deferred.emplace(lhs, lhs);
+      }
+    }
+  }
+  // and for every group that comes after one of them, the first such one
+  std::unordered_map<std::string, std::string> after;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto& [lhs, rhsGroup] : grammar.rules) {
+      if (!grammar.synthetic.contains(lhs)) {
+        continue;
+      }
+      for (const auto& rhs : rhsGroup) {
+        for (const auto& s : rhs) {
+          if (!deferred.contains(lhs) && deferred.contains(s)) {
+            deferred.emplace(lhs, deferred.at(s));
+            changed = true;
+          }
+        }
+      }
+    }
+    for (const auto& [lhs, rhsGroup] : grammar.rules) {
+      for (const auto& rhs : rhsGroup) {
+        auto it = after.find(lhs);
+        std::string before = it != after.end() ? it->second : "";
+        for (const auto& s : rhs) {
+          if (!before.empty() && grammar.synthetic.contains(s) && !after.contains(s)) {
+            after.emplace(s, before);
+            changed = true;
+          }
+          if (before.empty() && deferred.contains(s)) {
+            before = deferred.at(s);
+          }
+        }
+      }
+    }
+  }
+
+  // An action reads the values of the children it %depends on or, without
+  // %depends, of all children before it
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      auto it = after.find(lhs);
+      std::string before = it != after.end() ? it->second : "";
+      for (const auto& s : rhs) {
+        if (before.empty() && deferred.contains(s)) {
+          before = deferred.at(s);
+        }
+        if (!IS_TS(s) || grammar.pure.contains(s)) {
+          continue;
+        }
+        std::string read = before;
+        if (auto deps = grammar.depends.find(s); deps != grammar.depends.end()) {
+          auto dep = std::find_if(deps->second.begin(), deps->second.end(), [&](const auto& d) { return deferred.contains(d); });
+          read = dep != deps->second.end() ? deferred.at(*dep) : "";
+        }
+        EXPECT(read.empty(), absl::StrFormat("%s reads the value of %s, which is set by a %%pure action, so it has to be %%pure too", s, read));
+      }
+    }
+  }
+}
+
+// Whether the node rhs is parsed into gets an item matching `pred` before
+// rhs[k]. Synthetic rules are parsed into the node of their owner, so for them
+// it also counts if such an item comes before every use of the rule.
+template <class TPred>
+bool ComesBefore(const TGrammar& grammar, const std::string& lhs, const std::vector<std::string>& rhs, std::size_t k, const TPred& pred, std::unordered_set<std::string>& visiting) {
+  if (ranges::any_of(rhs | ranges::views::take(k), pred)) {
+    return true;
+  }
+  if (!grammar.synthetic.contains(lhs)) {
+    return false;
+  }
+  if (!visiting.insert(lhs).second) {
+    return true;  // `x*` uses itself after x, that's decided by its other uses
+  }
+  bool set = true;
+  for (const auto& [user, rhsGroup] : grammar.rules) {
+    for (const auto& userRhs : rhsGroup) {
+      for (std::size_t i = 0; i < userRhs.size(); i++) {
+        if (userRhs[i] == lhs) {
+          set = set && ComesBefore(grammar, user, userRhs, i, pred, visiting);
+        }
+      }
+    }
+  }
+  visiting.erase(lhs);
+  return set;
+}
+
+// How many children items [begin, end) of rhs add to their node, unless
+// that depends on the input
+std::optional<std::uint32_t> FixedChildren(const TGrammar& grammar, const std::vector<std::string>& rhs, std::size_t begin, std::size_t end) {
+  std::uint32_t count = 0;
+  for (auto i = begin; i < end; i++) {
+    if (grammar.synthetic.contains(rhs[i]) || grammar.inlined.contains(rhs[i])) {
+      return std::nullopt;
+    }
+    count += IS_TS(rhs[i]) || rhs[i] == "EPS" ? 0 : 1;
+  }
+  return count;
+}
+
+// The index of the first child the rules of lhs add to their node, if it is
+// always the same. A synthetic rule that repeats starts further on each time.
+std::optional<std::uint32_t> StartIndex(const TGrammar& grammar, const std::string& lhs, std::unordered_set<std::string>& visiting) {
+  if (!grammar.synthetic.contains(lhs)) {
+    return 0;
+  }
+  if (!visiting.insert(lhs).second) {
+    return std::nullopt;
+  }
+  std::optional<std::uint32_t> start;
+  bool fixed = true;
+  for (const auto& [user, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      for (std::size_t i = 0; i < rhs.size() && fixed; i++) {
+        if (rhs[i] != lhs) {
+          continue;
+        }
+        auto userStart = StartIndex(grammar, user, visiting);
+        auto before = FixedChildren(grammar, rhs, 0, i);
+        fixed = userStart && before && (!start || *start == *userStart + *before);
+        start = fixed ? std::optional{*userStart + *before} : std::nullopt;
+      }
+    }
+  }
+  visiting.erase(lhs);
+  return fixed ? start : std::nullopt;
+}
+
+// Where nterm is for an action at rhs[k], found the way ComesBefore finds it:
+// by index when nothing before it varies, else by distance when nothing
+// between varies. Through a synthetic rule only an index holds, since the
+// action can be any number of children past the use.
+std::optional<TChildIndex> FindChild(const TGrammar& grammar, const std::string& lhs, const std::vector<std::string>& rhs, std::size_t k, const std::string& nterm, std::unordered_set<std::string>& visiting) {
+  for (auto j = k; j-- > 0;) {
+    if (rhs[j] != nterm) {
+      continue;
+    }
+    std::unordered_set<std::string> starting;
+    auto start = StartIndex(grammar, lhs, starting);
+    if (auto before = FixedChildren(grammar, rhs, 0, j); start && before) {
+      return TChildIndex{false, *start + *before};
+    }
+    if (auto between = FixedChildren(grammar, rhs, j + 1, k)) {
+      return TChildIndex{true, *between + 1};
+    }
+    return std::nullopt;
+  }
+  if (!grammar.synthetic.contains(lhs) || !visiting.insert(lhs).second) {
+    return std::nullopt;
+  }
+  std::optional<TChildIndex> found;
+  bool fixed = true;
+  for (const auto& [user, rhsGroup] : grammar.rules) {
+    for (const auto& userRhs : rhsGroup) {
+      for (std::size_t i = 0; i < userRhs.size() && fixed; i++) {
+        if (userRhs[i] != lhs || visiting.contains(user)) {
+          continue;  // `x*` uses itself after x, the other uses decide
+        }
+        auto child = FindChild(grammar, user, userRhs, i, nterm, visiting);
+        fixed = child && !child->fromAction && (!found || found->offset == child->offset);
+        found = child;
+      }
+    }
+  }
+  visiting.erase(lhs);
+  return fixed ? found : std::nullopt;
+}
+
+TChildIndex DependencyIndex(const TGrammar& grammar, const std::string& symbol, const std::string& nterm) {
+  std::optional<TChildIndex> index;
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      for (std::size_t i = 0; i < rhs.size(); i++) {
+        if (rhs[i] != symbol) {
+          continue;
+        }
+        std::unordered_set<std::string> visiting;
+        auto found = FindChild(grammar, lhs, rhs, i, nterm, visiting);
+        EXPECT(found.has_value(),
+            absl::StrFormat("%s depends on %s, but a group before it leaves open which child that is", symbol, nterm));
+        EXPECT(!index || (index->fromAction == found->fromAction && index->offset == found->offset),
+            absl::StrFormat("%s depends on %s, which is a different child in each of its rules", symbol, nterm));
+        index = found;
+      }
+    }
+  }
+  EXPECT(index.has_value(), absl::StrFormat("%%depends %s isn't used in any rule", symbol));
+  return *index;
+}
+
+void CheckDepends(const TGrammar& grammar) {
+  if (grammar.depends.empty()) {
+    return;
+  }
+  auto nodeOf = [&grammar](const std::string& nterm) {
+    auto it = grammar.synthetic.find(nterm);
+    return it == grammar.synthetic.end() ? nterm : it->second.owner;
+  };
+  std::unordered_set<std::string> used;
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    const auto node = nodeOf(lhs);
+    for (const auto& rhs : rhsGroup) {
+      for (std::size_t i = 0; i < rhs.size(); i++) {
+        if (!IS_TS(rhs[i])) {
+          continue;
+        }
+        used.insert(rhs[i]);
+        auto it = grammar.depends.find(rhs[i]);
+        EXPECT(it != grammar.depends.end(), absl::StrFormat("%s has no %%depends (once some symbol has it, all need it)", rhs[i]));
+        for (const auto& dep : it->second) {
+          if (dep != "parent") {
+            std::unordered_set<std::string> visiting;
+            EXPECT(ComesBefore(grammar, lhs, rhs, i, [&dep](const std::string& s) { return s == dep; }, visiting),
+                absl::StrFormat("%s depends on %s, which isn't parsed before it in the rule for %s", rhs[i], dep, node));
+            DependencyIndex(grammar, rhs[i], dep);
+            continue;
+          }
+          EXPECT(node != "start", absl::StrFormat("%s depends on parent, but start has none", rhs[i]));
+          for (const auto& [user, userGroup] : grammar.rules) {
+            for (const auto& userRhs : userGroup) {
+              for (std::size_t k = 0; k < userRhs.size(); k++) {
+                std::unordered_set<std::string> visiting;
+                // every action sets the value of its node
+                EXPECT(userRhs[k] != node || ComesBefore(grammar, user, userRhs, k, IS_TS, visiting),
+                    absl::StrFormat("%s depends on parent, but no action of %s sets its value before %s is parsed", rhs[i], nodeOf(user), node));
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  for (const auto& [symbol, deps] : grammar.depends) {
+    EXPECT(used.contains(symbol), absl::StrFormat("%%depends %s isn't used in any rule", symbol));
+  }
+}
+
+void CheckBatch(const TGrammar& grammar) {
+  for (const auto& symbol : grammar.batch) {
+    auto it = grammar.depends.find(symbol);
+    EXPECT(it != grammar.depends.end(), absl::StrFormat("%%batch %s needs an empty %%depends", symbol));
+    EXPECT(it->second.empty(), absl::StrFormat("%%batch %s can't depend on anything", symbol));
+  }
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& rhs : rhsGroup) {
+      for (std::size_t i = 0; i < rhs.size(); i++) {
+        if (!grammar.batch.contains(rhs[i])) {
+          continue;
+        }
+        EXPECT(!grammar.synthetic.contains(lhs), absl::StrFormat("%%batch %s can't be inside a group", rhs[i]));
+        EXPECT(ranges::none_of(rhs | ranges::views::take(i), IS_TS), absl::StrFormat("%%batch %s has to be the first action in the rule for %s", rhs[i], lhs));
+      }
+    }
+  }
+}
+
 std::shared_ptr<TGrammar> ParseGrammar(const std::string& grammarString) {
 
   TGrammar grammar;
@@ -32,31 +514,46 @@ std::shared_ptr<TGrammar> ParseGrammar(const std::string& grammarString) {
 
   EXPECT(!utils::OneOf("EPS", grammar.tokenToRegex | ranges::views::keys), "Don't define reserved token EPS");
   EXPECT(!utils::OneOf("MY_EOF", grammar.tokenToRegex | ranges::views::keys), "Don't define reserved token MY_EOF");
+  grammar.keywords = FindKeywords(grammar);
 
   for (auto productionGroup : absl::StrSplit(productions, ';', absl::SkipWhitespace())) {
+    if (utils::Trim(productionGroup).front() == '%') {
+      ParseDirective(grammar, productionGroup);
+      continue;
+    }
     auto [nonTermId, ps] = ConstSplit<2>(productionGroup, ":");
 
     nonTermId = utils::Trim(nonTermId);
     EXPECT(IS_NTERM(nonTermId), absl::StrFormat("Non-terminal doesn't match the format: `%s`", nonTermId));
 
-    auto& ruleGroup = grammar.rules[nonTermId];
+    TProductionParser parser{grammar, nonTermId, TokenizeProductions(ps)};
+    auto alternatives = parser.ParseAlternatives();
+    EXPECT(parser.pos == parser.toks.size(), absl::StrFormat("Unbalanced parentheses in the rule for `%s`", nonTermId));
 
-    for (auto production : absl::StrSplit(ps, '|')) {
-      EXPECT(!(production | ranges::views::filter([](char c) { return !std::isspace(c); })).empty(), "Empty productions are prohibited");
-
-      std::vector<std::string> vec{absl::StrSplit(production, ' ', absl::SkipWhitespace())};
-      vec |= ranges::actions::transform([] (std::string& s) { return utils::Trim(s); });
+    // NOTE: the parser may add synthetic rules, so take the reference only now
+    auto& ruleGroup = grammar.rules[nonTermId];
+    for (auto& rhs : alternatives) {
+      ruleGroup.push_back(std::move(rhs));
+    }
+  }
 
+  for (const auto& [lhs, rhsGroup] : grammar.rules) {
+    for (const auto& vec : rhsGroup) {
       EXPECT(ranges::all_of(vec, [] (const std::string& s) {
             return IS_TOKEN(s) || IS_NTERM(s) || IS_TS(s);
       }), "The right hand side of the production should only contain tokens, nonterminals or translating symbols");
 
       EXPECT(ranges::none_of(vec, [] (const std::string& s) { return s == "MY_EOF"; }), "Don't use reserved MY_EOF terminal");
-
-      ruleGroup.push_back(vec);
     }
   }
 
+  if (grammar.split) {
+    CheckSplit(grammar);
+  }
+  CheckPure(grammar);
+  CheckDepends(grammar);
+  CheckBatch(grammar);
+
   return std::make_shared<TGrammar>(std::move(grammar));
 }
 
@@ -192,3 +689,278 @@ bool TGrammar::IsLL1() {
   }
   return true;
 }
+
+bool TGrammar::IsTailRecursive(const std::string& nonTerm) const {
+  bool recursive{false};
+  bool nonRecursive{false};
+  for (const auto& rhs : rules.at(nonTerm)) {
+    auto self = ranges::find(rhs, nonTerm);
+    if (self == rhs.end()) {
+      nonRecursive = true;
+      continue;
+    }
+    if (!ranges::all_of(self + 1, rhs.end(), IS_TS)) {
+      return false;
+    }
+    recursive = true;
+  }
+  return recursive && nonRecursive;
+}
+
+std::unordered_set<std::string> TGrammar::FindInlinable(std::size_t maxSize) const {
+  // synthetic rules are parsed into the node of their owner, so attribute
+  // everything to the owner
+  auto ownerOf = [this] (const std::string& lhs) {
+    auto it = synthetic.find(lhs);
+    return it == synthetic.end() ? lhs : it->second.owner;
+  };
+
+  std::unordered_set<std::string> withActions;
+  std::unordered_map<std::string, std::size_t> uses;
+  std::unordered_map<std::string, std::size_t> size;
+  std::unordered_map<std::string, std::unordered_set<std::string>> callers;
+  std::unordered_map<std::string, std::unordered_set<std::string>> callees;
+  for (const auto& [lhs, rhsGroup] : rules) {
+    auto owner = ownerOf(lhs);
+    for (const auto& rhs : rhsGroup) {
+      for (const auto& item : rhs) {
+        if (IS_TS(item)) {
+          withActions.insert(owner);
+        } else if (IS_NTERM(item) && !synthetic.contains(item)) {
+          uses[item]++;
+          callers[item].insert(owner);
+          callees[owner].insert(item);
+        }
+        if (item != "EPS" && !synthetic.contains(item)) {
+          size[owner]++;
+        }
+      }
+    }
+  }
+
+  std::unordered_set<std::string> result;
+  for (const auto& [lhs, rhsGroup] : rules) {
+    if (lhs == "start" || synthetic.contains(lhs) || withActions.contains(lhs) || callers[lhs].contains(lhs)) {
+      continue;
+    }
+    // the callers would see their children shifted, the callees a different parent
+    if (ranges::any_of(callers[lhs], [&] (const auto& c) { return withActions.contains(c); })
+        || ranges::any_of(callees[lhs], [&] (const auto& c) { return withActions.contains(c); })) {
+      continue;
+    }
+    if (uses[lhs] == 1 || size[lhs] <= maxSize) {
+      result.insert(lhs);
+    }
+  }
+
+  // inlining a cycle would never end, so drop nonterminals that can reach
+  // themselves through other inlined ones
+  bool change{true};
+  while (change) {
+    change = false;
+    auto candidates = result | ranges::to<std::vector<std::string>>();
+    ranges::sort(candidates);  // deterministic output
+    for (const auto& start : candidates) {
+      std::vector<std::string> stack{start};
+      std::unordered_set<std::string> seen;
+      bool cycle{false};
+      while (!stack.empty() && !cycle) {
+        auto cur = std::move(stack.back());
+        stack.pop_back();
+        for (const auto& next : callees[cur]) {
+          cycle = cycle || next == start;
+          if (result.contains(next) && seen.insert(next).second) {
+            stack.push_back(next);
+          }
+        }
+      }
+      if (cycle) {
+        result.erase(start);
+        change = true;
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+bool CanMatchWhitespace(std::string_view regex) {
+  constexpr auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\n'; };
+  constexpr std::string_view SAFE_CLASSES[] = {"alnum", "alpha", "digit", "lower", "upper", "xdigit", "punct", "w", "d"};
+  bool inClass = false;
+  for (std::size_t i = 0; i < regex.size(); i++) {
+    const char c = regex[i];
+    if (isSpace(c)) {
+      return true;
+    }
+    if (c == '\\') {
+      if (++i == regex.size()) {
+        return true;  // malformed, let std::regex complain
+      }
+      // \s, \W and \D include whitespace, \x, \u, \c and octal escapes may
+      // spell it
+      if (std::string_view{"sWDtnxuc0123456789"}.find(regex[i]) != std::string_view::npos) {
+        return true;
+      }
+      continue;
+    }
+    if (!inClass) {
+      if (c == '.') {
+        return true;
+      }
+      if (c == '[') {
+        inClass = true;
+        if (i + 1 < regex.size() && regex[i + 1] == '^') {
+          return true;
+        }
+        if (i + 1 < regex.size() && regex[i + 1] == ']') {
+          i++;  // a leading ']' is a literal
+        }
+      }
+      continue;
+    }
+    if (c == ']') {
+      inClass = false;
+    } else if (c == '[' && i + 1 < regex.size() && regex[i + 1] == ':') {
+      const auto end = regex.find(":]", i + 2);
+      if (end == std::string_view::npos) {
+        return true;
+      }
+      const auto name = regex.substr(i + 2, end - i - 2);
+      if (ranges::find(SAFE_CLASSES, name) == std::end(SAFE_CLASSES)) {
+        return true;
+      }
+      i = end + 1;
+    } else if (c == '-' && i > 0 && i + 1 < regex.size() && regex[i - 1] != '[' && regex[i + 1] != ']') {
+      // a range, the escaped bounds were rejected above
+      const char from = regex[i - 1];
+      const char to = regex[i + 1];
+      if ((from <= ' ' && ' ' <= to) || (from <= '\t' && '\t' <= to) || (from <= '\n' && '\n' <= to)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+std::optional<std::string> RegexLiteral(std::string_view regex) {
+  constexpr std::string_view SPECIAL = ".^$|()[]{}*+?\\";
+  std::string literal;
+  for (std::size_t i = 0; i < regex.size(); i++) {
+    const char c = regex[i];
+    if (c == '\\') {
+      if (i + 1 == regex.size() || !std::ispunct(static_cast<unsigned char>(regex[i + 1]))) {
+        return std::nullopt;  // \d, \w, \n and the like
+      }
+      literal.push_back(regex[++i]);
+    } else if (c == '[') {
+      if (i + 2 >= regex.size() || regex[i + 2] != ']' || regex[i + 1] == '^' || regex[i + 1] == '\\') {
+        return std::nullopt;
+      }
+      literal.push_back(regex[i + 1]);
+      i += 2;
+    } else if (SPECIAL.find(c) != std::string_view::npos) {
+      return std::nullopt;
+    } else {
+      literal.push_back(c);
+    }
+  }
+  if (literal.empty()) {
+    return std::nullopt;
+  }
+  return literal;
+}
+
+std::unordered_map<std::string, std::string> FindKeywords(const TGrammar& grammar) {
+  // anchors and lookaheads make the match depend on what follows the literal
+  constexpr auto looksAround = [](std::string_view regex) {
+    for (std::size_t i = 0; i < regex.size(); i++) {
+      if (regex[i] == '\\' && i + 1 < regex.size()) {
+        if (regex[i + 1] == 'b' || regex[i + 1] == 'B') {
+          return true;
+        }
+        i++;
+      } else if (regex[i] == '$' || (regex[i] == '^' && (i == 0 || regex[i - 1] != '[')) || regex.substr(i, 2) == "(?") {
+        return true;
+      }
+    }
+    return false;
+  };
+  std::unordered_map<std::string, std::string> literals;
+  for (const auto& token : grammar.tokenPrecedence) {
+    if (auto literal = RegexLiteral(grammar.tokenToRegex.at(token)); literal) {
+      literals[token] = *literal;
+    }
+  }
+  std::unordered_map<std::string, std::string> keywords;
+  for (const auto& [token, literal] : literals) {
+    for (const auto& other : grammar.tokenPrecedence) {
+      const auto& regex = grammar.tokenToRegex.at(other);
+      if (literals.contains(other) || looksAround(regex)) {
+        continue;
+      }
+      // the way the lexer matches (leftmost, not longest): on any input
+      // starting with the literal, the first successful path is this one or
+      // one that gets past the literal
+      std::smatch m;
+      if (std::regex_search(literal, m, std::regex{regex}, std::regex_constants::match_continuous) && m.length(0) == literal.size()) {
+        keywords[token] = literal;
+        break;
+      }
+    }
+  }
+  return keywords;
+}
+
+std::uint32_t KeywordHash(std::string_view text, std::uint32_t seed) {
+  std::uint32_t h = 2166136261u ^ seed;
+  for (unsigned char c : text) {
+    h = (h ^ c) * 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+TKeywordHash BuildKeywordHash(const std::vector<std::string>& words) {
+  std::size_t slotCount = 1;
+  while (slotCount < words.size()) {
+    slotCount *= 2;
+  }
+  for (;; slotCount *= 2) {
+    for (std::uint32_t seed = 0; seed < 1000; seed++) {
+      std::vector<bool> used(slotCount);
+      const bool perfect = ranges::all_of(words, [&](const std::string& word) {
+        const auto slot = KeywordHash(word, seed) & (slotCount - 1);
+        return !used[slot] && (used[slot] = true);
+      });
+      if (perfect) {
+        return {seed, slotCount};
+      }
+    }
+  }
+}
+
+std::optional<std::vector<std::pair<char, char>>> CharClassRun(std::string_view regex) {
+  if (regex.size() < 4 || regex.front() != '[' || regex.substr(regex.size() - 2) != "]+") {
+    return std::nullopt;
+  }
+  const auto body = regex.substr(1, regex.size() - 3);
+  if (body.empty() || body.front() == '^' || body.find_first_of("[]\\") != std::string_view::npos) {
+    return std::nullopt;
+  }
+  std::vector<std::pair<char, char>> ranges;
+  for (std::size_t i = 0; i < body.size(); i++) {
+    if (i + 2 < body.size() && body[i + 1] == '-') {
+      if (body[i] > body[i + 2]) {
+        return std::nullopt;  // let std::regex complain
+      }
+      ranges.emplace_back(body[i], body[i + 2]);
+      i += 2;
+    } else {
+      ranges.emplace_back(body[i], body[i]);
+    }
+  }
+  if (ranges.size() > 4) {
+    return std::nullopt;
+  }
+  return ranges;
+}
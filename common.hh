@@ -4,6 +4,7 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <optional>
 #include <regex>
 
 #include <range/v3/view/any_view.hpp>
@@ -21,9 +22,39 @@ constexpr auto IS_TOKEN = [] (std::string_view s) { return std::regex_match(s.be
 constexpr auto IS_NTERM = [] (std::string_view s) { return std::regex_match(s.begin(), s.end(), NONTERMINAL_REGEX); };
 constexpr auto IS_TS = [] (std::string_view s) { return std::regex_match(s.begin(), s.end(), TS_REGEX); };
 
+enum class ESynthetic {
+  Group,     // ( a | b )
+  Optional,  // ( a | b )?
+  Star,      // ( a | b )*, the group followed by the nonterminal itself | EPS
+};
+
+// Nonterminal introduced for an EBNF operator. It takes part in FIRST/FOLLOW
+// like any other nonterminal, but has no node and no parse method: its symbols
+// are parsed inline into the node of `owner`. `x+` is a Group of `x x*`.
+struct TSynthetic {
+  ESynthetic kind;
+  std::string owner;
+};
+
+// `%split SEP;` in the rules section: start is `item ( SEP item )*` and SEP
+// can't occur inside item, so the tokens can be cut at every SEP and the
+// items parsed independently. Actions under item need %depends.
+struct TSplit {
+  std::string item;
+  std::string separator;
+};
+
 struct TGrammar {
   std::vector<std::string> tokenPrecedence;
   std::unordered_map<std::string, std::string> tokenToRegex;
+  // `%value TOKEN int|int64|uint64|float|intern;`: the C++ type the lexer
+  // converts the token's text to (TSymbol for intern), the leaf gets it as its
+  // value
+  std::unordered_map<std::string, std::string> tokenValue;
+  // Literal tokens that some other token matches too (see FindKeywords) ->
+  // their text. The lexer doesn't try them, it looks up what the other token
+  // matched.
+  std::unordered_map<std::string, std::string> keywords;
   std::unordered_map<std::string, std::vector<std::vector<std::string>>> rules;
 
   // nonTerm -> set of tokens that can follow it
@@ -35,10 +66,45 @@ struct TGrammar {
   // lhs -> (FIRST1(rhs), rhs)
   std::unordered_map<std::string, std::pair<std::vector<std::string>, std::unordered_set<std::string>>> first1;
 
+  std::unordered_map<std::string, TSynthetic> synthetic;
+
+  // nonterminals that are parsed inline into the node of their caller
+  std::unordered_set<std::string> inlined;
+
+  std::optional<TSplit> split;
+
+  // `%pure $a $b;`: translation symbols whose actions only read the values of
+  // the node's children and only write the node's value. Each must be the
+  // last symbol of its alternatives, so the actions can run after the parse,
+  // bottom-up and in parallel. Actions reading their values must be %pure too.
+  std::unordered_set<std::string> pure;
+
+  // `%depends $a parent b;`: the values the action of $a reads, the parent's
+  // (as set before the node is parsed) or the node's child b (parsed before
+  // $a). Once one symbol has it, every symbol needs one, and the actions can
+  // run lazily on demand.
+  std::unordered_map<std::string, std::vector<std::string>> depends;
+
+  // `%batch $a;`: actions that depend on nothing (an empty %depends) and come
+  // first in their node, so after a lazy parse all of them can run at once,
+  // grouped by symbol. Eager and DeferPure parsers run them one by one.
+  std::unordered_set<std::string> batch;
+
   void CalculateFIRST();
   void CalculateFOLLOW();
   bool IsLL1();
 
+  // nonTerm refers to itself only as the last symbol (not counting translation
+  // symbols) of some of its alternatives, and has a non-recursive alternative
+  bool IsTailRecursive(const std::string& nonTerm) const;
+
+  // Nonterminals that can be parsed right into the node of their caller
+  // without any translation symbol noticing: there are no translation symbols
+  // in their rules, in the rules of their callers or in the rules of the
+  // nonterminals they refer to. Only the ones used once or having at most
+  // maxSize symbols are chosen.
+  std::unordered_set<std::string> FindInlinable(std::size_t maxSize) const;
+
 // TODO: CalculateFIRST1, CalculateFOLLOW, устранить бесполезные символы (надо
 // погуглить как  это делается, в конспекте под определением FIRST содержится
 // описание бесполезных символов)
@@ -57,5 +123,48 @@ inline std::array<std::string, N> ConstSplit(std::string_view text, std::string_
   return arr;
 }
 
+// Conservative: false only if no string matched by the token regex can
+// contain a character the generated lexer skips as whitespace (' ', '\t',
+// '\n'). Such characters always separate tokens then.
+bool CanMatchWhitespace(std::string_view regex);
+
+// The only string the regex matches, if it is made of plain characters,
+// escaped punctuation and one-character classes like `[(]`
+std::optional<std::string> RegexLiteral(std::string_view regex);
+
+// Literal tokens that another token matches in full the way the lexer
+// matches (std::regex picks the first successful path, not the longest), so
+// wherever the literal matches, that token matches at least as much of the
+// input. Tokens with anchors or lookaheads don't count.
+std::unordered_map<std::string, std::string> FindKeywords(const TGrammar& grammar);
+
+// The byte ranges of a `[...]+` regex whose class has at most 4 ranges or
+// single characters and no negation, escapes or named classes. The lexer
+// scans such tokens with SIMD instead of std::regex.
+std::optional<std::vector<std::pair<char, char>>> CharClassRun(std::string_view regex);
+
+// Has to stay in sync with KeywordSlot in the generated lexer
+std::uint32_t KeywordHash(std::string_view text, std::uint32_t seed);
+
+// Seeds KeywordHash so that the words land in distinct slots of a table of
+// slotCount (a power of two) entries
+struct TKeywordHash {
+  std::uint32_t seed;
+  std::size_t slotCount;
+};
+
+TKeywordHash BuildKeywordHash(const std::vector<std::string>& words);
+
+// Where the child an action %depends on is in the action's node
+struct TChildIndex {
+  bool fromAction;  // offset counts back from the action, else from the first child
+  std::uint32_t offset;
+};
+
+// The child nterm that `%depends symbol nterm` reads. Groups add as many
+// children as they parse, so it has to be at the same index, or the same
+// distance before the action, wherever the grammar uses symbol.
+TChildIndex DependencyIndex(const TGrammar& grammar, const std::string& symbol, const std::string& nterm);
+
 std::unordered_set<std::string>& CalculateRecurFIRST(TGrammar& grammar, ranges::any_view<std::string, ranges::category::bidirectional | ranges::category::sized> alpha);
 std::shared_ptr<TGrammar> ParseGrammar(const std::string& grammarString);
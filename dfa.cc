@@ -0,0 +1,835 @@
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
+
+#include <absl/strings/str_format.h>
+
+#include "debug.hh"
+#include "dfa.hh"
+
+namespace {
+
+enum class ERegex {
+  Set,     // one byte out of set
+  Empty,   // matches the empty string
+  Concat,
+  Alt,
+  Star,
+};
+
+struct TRegexNode;
+using TRegexPtr = std::shared_ptr<const TRegexNode>;
+
+struct TRegexNode {
+  ERegex kind;
+  TByteSet set;
+  std::vector<TRegexPtr> children;
+};
+
+TRegexPtr MakeSet(TByteSet set) {
+  return std::make_shared<TRegexNode>(TRegexNode{ERegex::Set, set, {}});
+}
+
+TRegexPtr Make(ERegex kind, std::vector<TRegexPtr> children) {
+  return std::make_shared<TRegexNode>(TRegexNode{kind, {}, std::move(children)});
+}
+
+// Sorted, disjoint and non-adjacent [lo, hi] ranges of code points (of bytes
+// when the regex isn't UTF-8)
+using TCodeSet = std::vector<std::pair<std::uint32_t, std::uint32_t>>;
+
+constexpr std::uint32_t MAX_CODE_POINT = 0x10FFFF;
+
+TCodeSet Normalize(TCodeSet set) {
+  std::sort(set.begin(), set.end());
+  TCodeSet result;
+  for (const auto& [lo, hi] : set) {
+    if (!result.empty() && lo <= result.back().second + 1) {
+      result.back().second = std::max(result.back().second, hi);
+    } else {
+      result.emplace_back(lo, hi);
+    }
+  }
+  return result;
+}
+
+TCodeSet Union(TCodeSet a, const TCodeSet& b) {
+  a.insert(a.end(), b.begin(), b.end());
+  return Normalize(std::move(a));
+}
+
+TCodeSet Complement(const TCodeSet& set, std::uint32_t max) {
+  TCodeSet result;
+  std::uint32_t next = 0;
+  for (const auto& [lo, hi] : Normalize(set)) {
+    if (lo > next) {
+      result.emplace_back(next, lo - 1);
+    }
+    next = hi + 1;
+  }
+  if (next <= max) {
+    result.emplace_back(next, max);
+  }
+  return result;
+}
+
+TCodeSet Chars(std::string_view chars) {
+  TCodeSet set;
+  for (unsigned char c : chars) {
+    set.emplace_back(c, c);
+  }
+  return Normalize(std::move(set));
+}
+
+const TCodeSet DIGIT = {{'0', '9'}};
+const TCodeSet LOWER = {{'a', 'z'}};
+const TCodeSet UPPER = {{'A', 'Z'}};
+const TCodeSet WORD = Normalize({{'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'}});
+const TCodeSet SPACE = Chars(" \t\n\r\f\v");
+
+std::array<std::uint8_t, 4> EncodeUtf8(std::uint32_t c, std::size_t& length) {
+  if (c < 0x80) {
+    length = 1;
+    return {static_cast<std::uint8_t>(c)};
+  }
+  if (c < 0x800) {
+    length = 2;
+    return {static_cast<std::uint8_t>(0xC0 | (c >> 6)), static_cast<std::uint8_t>(0x80 | (c & 0x3F))};
+  }
+  if (c < 0x10000) {
+    length = 3;
+    return {static_cast<std::uint8_t>(0xE0 | (c >> 12)), static_cast<std::uint8_t>(0x80 | ((c >> 6) & 0x3F)),
+            static_cast<std::uint8_t>(0x80 | (c & 0x3F))};
+  }
+  length = 4;
+  return {static_cast<std::uint8_t>(0xF0 | (c >> 18)), static_cast<std::uint8_t>(0x80 | ((c >> 12) & 0x3F)),
+          static_cast<std::uint8_t>(0x80 | ((c >> 6) & 0x3F)), static_cast<std::uint8_t>(0x80 | (c & 0x3F))};
+}
+
+// Splits [lo, hi] into ranges whose UTF-8 encodings are products of byte
+// ranges, e.g. [U+0400, U+04FF] is [D0-D3][80-BF], and emits those
+using TByteRanges = std::vector<std::pair<std::uint8_t, std::uint8_t>>;
+
+template <class TEmit>
+void Utf8Sequences(std::uint32_t lo, std::uint32_t hi, TEmit&& emit) {
+  if (lo > hi) {
+    return;
+  }
+  if (lo <= 0xDFFF && hi >= 0xD800) {  // surrogates can't be encoded
+    if (lo < 0xD800) {
+      Utf8Sequences(lo, 0xD7FF, emit);
+    }
+    if (hi > 0xDFFF) {
+      Utf8Sequences(0xE000, hi, emit);
+    }
+    return;
+  }
+  for (std::uint32_t max : {0x7Fu, 0x7FFu, 0xFFFFu}) {
+    if (lo <= max && hi > max) {
+      Utf8Sequences(lo, max, emit);
+      Utf8Sequences(max + 1, hi, emit);
+      return;
+    }
+  }
+  std::size_t length;
+  EncodeUtf8(lo, length);
+  for (std::size_t i = 1; i < length; i++) {
+    const std::uint32_t m = (1u << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        Utf8Sequences(lo, lo | m, emit);
+        Utf8Sequences((lo | m) + 1, hi, emit);
+        return;
+      }
+      if ((hi & m) != m) {
+        Utf8Sequences(lo, (hi & ~m) - 1, emit);
+        Utf8Sequences(hi & ~m, hi, emit);
+        return;
+      }
+    }
+  }
+  const auto from = EncodeUtf8(lo, length);
+  const auto to = EncodeUtf8(hi, length);
+  TByteRanges ranges;
+  for (std::size_t i = 0; i < length; i++) {
+    ranges.emplace_back(from[i], to[i]);
+  }
+  emit(ranges);
+}
+
+TByteSet ByteRange(std::uint32_t from, std::uint32_t to) {
+  TByteSet set;
+  for (auto c = from; c <= to; c++) {
+    set.set(c);
+  }
+  return set;
+}
+
+// Recursive descent over the ECMAScript subset described in dfa.hh
+struct TRegexParser {
+  std::string_view re;
+  bool utf8;
+  std::size_t i{0};
+
+  TRegexPtr Parse() {
+    auto result = Alternation();
+    EXPECT(i == re.size(), absl::StrFormat("Unbalanced `)` in regex `%s`", re));
+    return result;
+  }
+
+  bool AtEnd() const {
+    return i == re.size();
+  }
+
+  std::uint32_t MaxChar() const {
+    return utf8 ? MAX_CODE_POINT : 0xFF;
+  }
+
+  // Bytes are their own code points unless the regex is UTF-8
+  TRegexPtr CodeSetNode(const TCodeSet& set) {
+    if (!utf8) {
+      TByteSet bytes;
+      for (const auto& [lo, hi] : set) {
+        bytes |= ByteRange(lo, hi);
+      }
+      return MakeSet(bytes);
+    }
+    TByteSet ascii;
+    std::vector<TRegexPtr> alternatives;
+    for (const auto& [lo, hi] : set) {
+      if (lo < 0x80) {
+        ascii |= ByteRange(lo, std::min<std::uint32_t>(hi, 0x7F));
+      }
+      Utf8Sequences(std::max<std::uint32_t>(lo, 0x80), hi, [&](const TByteRanges& ranges) {
+        std::vector<TRegexPtr> bytes;
+        for (const auto& [from, to] : ranges) {
+          bytes.push_back(MakeSet(ByteRange(from, to)));
+        }
+        alternatives.push_back(Make(ERegex::Concat, std::move(bytes)));
+      });
+    }
+    if (ascii.any() || alternatives.empty()) {
+      alternatives.insert(alternatives.begin(), MakeSet(ascii));
+    }
+    return alternatives.size() == 1 ? alternatives.front() : Make(ERegex::Alt, std::move(alternatives));
+  }
+
+  // The next character of the regex itself, a whole code point if UTF-8
+  std::uint32_t NextChar() {
+    const auto lead = static_cast<unsigned char>(re[i++]);
+    if (!utf8 || lead < 0x80) {
+      return lead;
+    }
+    const std::size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 0;
+    EXPECT(length != 0 && i + length - 1 <= re.size(), absl::StrFormat("Malformed UTF-8 in regex `%s`", re));
+    std::uint32_t c = lead & (0x7F >> length);
+    for (std::size_t k = 1; k < length; k++) {
+      const auto byte = static_cast<unsigned char>(re[i++]);
+      EXPECT((byte & 0xC0) == 0x80, absl::StrFormat("Malformed UTF-8 in regex `%s`", re));
+      c = (c << 6) | (byte & 0x3F);
+    }
+    return c;
+  }
+
+  TRegexPtr Alternation() {
+    std::vector<TRegexPtr> alternatives{Concatenation()};
+    while (!AtEnd() && re[i] == '|') {
+      i++;
+      alternatives.push_back(Concatenation());
+    }
+    return alternatives.size() == 1 ? alternatives.front() : Make(ERegex::Alt, std::move(alternatives));
+  }
+
+  TRegexPtr Concatenation() {
+    std::vector<TRegexPtr> items;
+    while (!AtEnd() && re[i] != '|' && re[i] != ')') {
+      items.push_back(Repetition());
+    }
+    if (items.empty()) {
+      return Make(ERegex::Empty, {});
+    }
+    return items.size() == 1 ? items.front() : Make(ERegex::Concat, std::move(items));
+  }
+
+  std::size_t Number() {
+    EXPECT(!AtEnd() && std::isdigit(static_cast<unsigned char>(re[i])), absl::StrFormat("Expected a number at %d in regex `%s`", i, re));
+    std::size_t n = 0;
+    while (!AtEnd() && std::isdigit(static_cast<unsigned char>(re[i]))) {
+      n = n * 10 + (re[i++] - '0');
+    }
+    return n;
+  }
+
+  TRegexPtr Repetition() {
+    auto atom = Atom();
+    while (!AtEnd() && std::string_view{"*+?{"}.find(re[i]) != std::string_view::npos) {
+      const char op = re[i++];
+      std::size_t min = 0;
+      std::size_t max = SIZE_MAX;  // unbounded
+      if (op == '+') {
+        min = 1;
+      } else if (op == '?') {
+        max = 1;
+      } else if (op == '{') {
+        min = max = Number();
+        if (!AtEnd() && re[i] == ',') {
+          i++;
+          max = !AtEnd() && re[i] == '}' ? SIZE_MAX : Number();
+        }
+        EXPECT(!AtEnd() && re[i] == '}' && min <= max, absl::StrFormat("Bad `{m,n}` in regex `%s`", re));
+        i++;
+      }
+      EXPECT(AtEnd() || re[i] != '?', absl::StrFormat("Lazy quantifiers are not supported: `%s`", re));
+      std::vector<TRegexPtr> items(min, atom);
+      if (max == SIZE_MAX) {
+        items.push_back(Make(ERegex::Star, {atom}));
+      } else {
+        // a{2,4} is aa(a(a)?)?
+        TRegexPtr optional = nullptr;
+        for (std::size_t k = min; k < max; k++) {
+          auto body = optional == nullptr ? atom : Make(ERegex::Concat, {atom, optional});
+          optional = Make(ERegex::Alt, {body, Make(ERegex::Empty, {})});
+        }
+        if (optional != nullptr) {
+          items.push_back(optional);
+        }
+      }
+      atom = items.empty() ? Make(ERegex::Empty, {}) : items.size() == 1 ? items.front() : Make(ERegex::Concat, std::move(items));
+    }
+    return atom;
+  }
+
+  TRegexPtr Atom() {
+    switch (re[i]) {
+      case '(': {
+        i++;
+        if (re.substr(i, 2) == "?:") {
+          i += 2;
+        }
+        EXPECT(AtEnd() || re[i] != '?', absl::StrFormat("Lookaheads are not supported: `%s`", re));
+        auto inner = Alternation();
+        EXPECT(!AtEnd() && re[i] == ')', absl::StrFormat("Unbalanced `(` in regex `%s`", re));
+        i++;
+        return inner;
+      }
+      case '[':
+        i++;
+        return CodeSetNode(Class());
+      case '.':
+        i++;
+        return CodeSetNode(Complement(Chars("\n\r"), MaxChar()));
+      case '\\':
+        i++;
+        return CodeSetNode(Escape(false));
+      case '^':
+      case '$':
+        throw std::runtime_error(absl::StrFormat("Anchors are not supported: `%s`", re));
+      case '*':
+      case '+':
+      case '?':
+      case '{':
+        throw std::runtime_error(absl::StrFormat("Nothing to repeat at %d in regex `%s`", i, re));
+      default: {
+        const auto c = NextChar();
+        return CodeSetNode({{c, c}});
+      }
+    }
+  }
+
+  std::uint32_t Hex(std::size_t digits) {
+    EXPECT(i + digits <= re.size() && std::all_of(re.begin() + i, re.begin() + i + digits, [](char c) { return std::isxdigit(static_cast<unsigned char>(c)); }),
+           absl::StrFormat("Bad hex escape in regex `%s`", re));
+    const auto value = static_cast<std::uint32_t>(std::stoul(std::string{re.substr(i, digits)}, nullptr, 16));
+    i += digits;
+    return value;
+  }
+
+  TCodeSet Escape(bool inClass) {
+    EXPECT(!AtEnd(), absl::StrFormat("Trailing `\\` in regex `%s`", re));
+    const char c = re[i++];
+    switch (c) {
+      case 'd': return DIGIT;
+      case 'D': return Complement(DIGIT, MaxChar());
+      case 'w': return WORD;
+      case 'W': return Complement(WORD, MaxChar());
+      case 's': return SPACE;
+      case 'S': return Complement(SPACE, MaxChar());
+      case 't': return Chars("\t");
+      case 'n': return Chars("\n");
+      case 'r': return Chars("\r");
+      case 'f': return Chars("\f");
+      case 'v': return Chars("\v");
+      case 'x': {
+        const auto byte = Hex(2);
+        return {{byte, byte}};
+      }
+      case 'u': {
+        EXPECT(utf8, absl::StrFormat("`\\u` needs --utf8: `%s`", re));
+        std::uint32_t code;
+        if (!AtEnd() && re[i] == '{') {
+          const auto end = re.find('}', i);
+          EXPECT(end != std::string_view::npos && end > i + 1, absl::StrFormat("Bad `\\u{...}` in regex `%s`", re));
+          i++;
+          code = Hex(end - i);
+          i++;
+        } else {
+          code = Hex(4);
+        }
+        EXPECT(code <= MAX_CODE_POINT && (code < 0xD800 || code > 0xDFFF), absl::StrFormat("Bad code point in regex `%s`", re));
+        return {{code, code}};
+      }
+      default:
+        EXPECT(std::ispunct(static_cast<unsigned char>(c)) || (inClass && c == 'b'),
+               absl::StrFormat("Unsupported escape `\\%c` in regex `%s`", c, re));
+        return c == 'b' ? Chars("\b") : Chars(std::string_view{&c, 1});
+    }
+  }
+
+  // After `[`, up to and including `]`
+  TCodeSet Class() {
+    static const std::map<std::string_view, TCodeSet> NAMED = {
+      {"alnum", Union(Union(LOWER, UPPER), DIGIT)},
+      {"alpha", Union(LOWER, UPPER)},
+      {"digit", DIGIT},
+      {"d", DIGIT},
+      {"lower", LOWER},
+      {"upper", UPPER},
+      {"xdigit", Normalize({{'0', '9'}, {'A', 'F'}, {'a', 'f'}})},
+      {"punct", Normalize({{'!', '/'}, {':', '@'}, {'[', '`'}, {'{', '~'}})},
+      {"space", SPACE},
+      {"s", SPACE},
+      {"blank", Chars(" \t")},
+      {"cntrl", Normalize({{0, 31}, {0x7F, 0x7F}})},
+      {"print", {{' ', '~'}}},
+      {"graph", {{'!', '~'}}},
+      {"w", WORD},
+    };
+    const bool negated = !AtEnd() && re[i] == '^';
+    if (negated) {
+      i++;
+    }
+    TCodeSet set;
+    // a single character, or a bound of a range
+    auto single = [&](TCodeSet& item) -> std::optional<std::uint32_t> {
+      if (re[i] == '\\') {
+        i++;
+        item = Escape(true);
+      } else {
+        const auto c = NextChar();
+        item = {{c, c}};
+      }
+      if (item.size() == 1 && item.front().first == item.front().second) {
+        return item.front().first;
+      }
+      return std::nullopt;
+    };
+    while (true) {
+      EXPECT(!AtEnd(), absl::StrFormat("Unbalanced `[` in regex `%s`", re));
+      if (re[i] == ']') {
+        i++;
+        break;
+      }
+      if (re.substr(i, 2) == "[:") {
+        const auto end = re.find(":]", i + 2);
+        EXPECT(end != std::string_view::npos, absl::StrFormat("Unbalanced `[:` in regex `%s`", re));
+        auto it = NAMED.find(re.substr(i + 2, end - i - 2));
+        EXPECT(it != NAMED.end(), absl::StrFormat("Unknown class `%s` in regex `%s`", re.substr(i, end + 2 - i), re));
+        set = Union(std::move(set), it->second);
+        i = end + 2;
+        continue;
+      }
+      TCodeSet item;
+      const auto from = single(item);
+      if (from && i + 1 < re.size() && re[i] == '-' && re[i + 1] != ']') {
+        i++;
+        TCodeSet bound;
+        const auto to = single(bound);
+        EXPECT(to && *from <= *to, absl::StrFormat("Bad range in regex `%s`", re));
+        item = {{*from, *to}};
+      }
+      set = Union(std::move(set), item);
+    }
+    return negated ? Complement(set, MaxChar()) : set;
+  }
+};
+
+// Thompson NFA: every state has at most one byte-set edge and any number of
+// epsilon edges
+struct TNfa {
+  struct TState {
+    TByteSet set;
+    std::int32_t target{DFA_NO_STATE};
+    std::vector<std::int32_t> eps;
+    std::int32_t accept{DFA_NO_TOKEN};
+  };
+
+  std::vector<TState> states;
+
+  std::int32_t Add() {
+    states.emplace_back();
+    return static_cast<std::int32_t>(states.size() - 1);
+  }
+
+  // (start, end) of a fragment matching the node
+  std::pair<std::int32_t, std::int32_t> Compile(const TRegexNode& node) {
+    const auto start = Add();
+    switch (node.kind) {
+      case ERegex::Set: {
+        const auto end = Add();
+        states[start].set = node.set;
+        states[start].target = end;
+        return {start, end};
+      }
+      case ERegex::Empty: {
+        const auto end = Add();
+        states[start].eps.push_back(end);
+        return {start, end};
+      }
+      case ERegex::Concat: {
+        auto last = start;
+        for (const auto& child : node.children) {
+          const auto [s, e] = Compile(*child);
+          states[last].eps.push_back(s);
+          last = e;
+        }
+        return {start, last};
+      }
+      case ERegex::Alt: {
+        const auto end = Add();
+        for (const auto& child : node.children) {
+          const auto [s, e] = Compile(*child);
+          states[start].eps.push_back(s);
+          states[e].eps.push_back(end);
+        }
+        return {start, end};
+      }
+      case ERegex::Star: {
+        const auto end = Add();
+        const auto [s, e] = Compile(*node.children.front());
+        states[start].eps.push_back(s);
+        states[start].eps.push_back(end);
+        states[e].eps.push_back(s);
+        states[e].eps.push_back(end);
+        return {start, end};
+      }
+    }
+    throw std::runtime_error("Unreachable statement");
+  }
+
+  void Closure(std::vector<std::int32_t>& set) const {
+    std::vector<bool> seen(states.size());
+    for (auto s : set) {
+      seen[s] = true;
+    }
+    for (std::size_t k = 0; k < set.size(); k++) {
+      for (auto t : states[set[k]].eps) {
+        if (!seen[t]) {
+          seen[t] = true;
+          set.push_back(t);
+        }
+      }
+    }
+    std::sort(set.begin(), set.end());
+  }
+};
+
+}  // namespace
+
+TDfa BuildDfa(const std::vector<std::string>& regexes, bool utf8) {
+  TNfa nfa;
+  const auto start = nfa.Add();
+  for (std::size_t k = 0; k < regexes.size(); k++) {
+    const auto [s, e] = nfa.Compile(*TRegexParser{regexes[k], utf8}.Parse());
+    nfa.states[start].eps.push_back(s);
+    nfa.states[e].accept = static_cast<std::int32_t>(k);
+  }
+
+  TDfa dfa;
+  // bytes in the same class are in exactly the same edge sets
+  dfa.classCount = 1;
+  for (const auto& state : nfa.states) {
+    if (state.target == DFA_NO_STATE) {
+      continue;
+    }
+    std::map<std::pair<std::uint8_t, bool>, std::uint8_t> split;
+    for (unsigned c = 0; c < 256; c++) {
+      auto [it, _] = split.emplace(std::pair{dfa.classOf[c], state.set.test(c)}, split.size());
+      dfa.classOf[c] = it->second;
+    }
+    dfa.classCount = split.size();
+  }
+  std::vector<unsigned> representative(dfa.classCount);
+  for (unsigned c = 256; c-- > 0;) {
+    representative[dfa.classOf[c]] = c;
+  }
+
+  std::map<std::vector<std::int32_t>, std::int32_t> ids;
+  std::vector<std::vector<std::int32_t>> sets;
+  auto idOf = [&](std::vector<std::int32_t> set) {
+    nfa.Closure(set);
+    if (set.empty()) {
+      return DFA_NO_STATE;
+    }
+    auto [it, inserted] = ids.emplace(set, static_cast<std::int32_t>(sets.size()));
+    if (inserted) {
+      sets.push_back(std::move(set));
+    }
+    return it->second;
+  };
+  dfa.start = idOf({start});
+  for (std::size_t d = 0; d < sets.size(); d++) {
+    std::int32_t accept = DFA_NO_TOKEN;
+    for (auto s : sets[d]) {
+      const auto a = nfa.states[s].accept;
+      if (a != DFA_NO_TOKEN && (accept == DFA_NO_TOKEN || a < accept)) {
+        accept = a;
+      }
+    }
+    std::vector<std::int32_t> row(dfa.classCount);
+    for (std::size_t c = 0; c < dfa.classCount; c++) {
+      std::vector<std::int32_t> move;
+      for (auto s : sets[d]) {
+        if (nfa.states[s].target != DFA_NO_STATE && nfa.states[s].set.test(representative[c])) {
+          move.push_back(nfa.states[s].target);
+        }
+      }
+      row[c] = idOf(std::move(move));  // may grow sets
+    }
+    dfa.next.push_back(std::move(row));
+    dfa.accept.push_back(accept);
+  }
+  return dfa;
+}
+
+TDfa MinimizeDfa(const TDfa& dfa) {
+  // reachable states plus an explicit dead state, so the DFA is complete
+  const auto n = static_cast<std::int32_t>(dfa.next.size());
+  const auto dead = n;
+  const auto k = dfa.classCount;
+  auto next = [&](std::int32_t s, std::size_t c) {
+    return s == dead || dfa.next[s][c] == DFA_NO_STATE ? dead : dfa.next[s][c];
+  };
+  std::vector<bool> reachable(n + 1);
+  std::vector<std::int32_t> order{dfa.start, dead};
+  reachable[dfa.start] = reachable[dead] = true;
+  for (std::size_t q = 0; q < order.size(); q++) {
+    for (std::size_t c = 0; c < k; c++) {
+      if (auto t = next(order[q], c); !reachable[t]) {
+        reachable[t] = true;
+        order.push_back(t);
+      }
+    }
+  }
+  std::vector<std::vector<std::vector<std::int32_t>>> inverse(k, std::vector<std::vector<std::int32_t>>(n + 1));
+  for (auto s : order) {
+    for (std::size_t c = 0; c < k; c++) {
+      inverse[c][next(s, c)].push_back(s);
+    }
+  }
+
+  // initial partition by the accepted token
+  std::vector<std::vector<std::int32_t>> blocks;
+  std::vector<std::int32_t> blockOf(n + 1, -1);
+  {
+    std::map<std::int32_t, std::int32_t> byToken;
+    for (auto s : order) {
+      const auto token = s == dead ? DFA_NO_TOKEN : dfa.accept[s];
+      auto [it, inserted] = byToken.emplace(token, static_cast<std::int32_t>(blocks.size()));
+      if (inserted) {
+        blocks.emplace_back();
+      }
+      blocks[it->second].push_back(s);
+      blockOf[s] = it->second;
+    }
+  }
+  std::deque<std::int32_t> work(blocks.size());
+  std::iota(work.begin(), work.end(), 0);
+  std::vector<bool> inWork(blocks.size(), true);
+  std::vector<bool> marked(n + 1);
+  while (!work.empty()) {
+    const auto splitter = blocks[work.front()];
+    inWork[work.front()] = false;
+    work.pop_front();
+    for (std::size_t c = 0; c < k; c++) {
+      std::map<std::int32_t, std::vector<std::int32_t>> touched;  // block -> its states going into splitter
+      for (auto t : splitter) {
+        for (auto s : inverse[c][t]) {
+          if (!marked[s]) {
+            marked[s] = true;
+            touched[blockOf[s]].push_back(s);
+          }
+        }
+      }
+      for (auto& [y, inside] : touched) {
+        if (inside.size() < blocks[y].size()) {
+          const auto z = static_cast<std::int32_t>(blocks.size());
+          std::vector<std::int32_t> outside;
+          for (auto s : blocks[y]) {
+            if (!marked[s]) {
+              outside.push_back(s);
+            }
+          }
+          for (auto s : inside) {
+            blockOf[s] = z;
+          }
+          blocks[y] = std::move(outside);
+          blocks.push_back(inside);
+          inWork.push_back(false);
+          if (inWork[y] || inside.size() <= blocks[y].size()) {
+            work.push_back(z);
+            inWork[z] = true;
+          } else {
+            work.push_back(y);
+            inWork[y] = true;
+          }
+        }
+        for (auto s : inside) {
+          marked[s] = false;
+        }
+      }
+    }
+  }
+
+  // number the blocks in BFS order from the start, dropping the dead one
+  TDfa result;
+  result.classOf = dfa.classOf;
+  result.classCount = k;
+  std::vector<std::int32_t> id(blocks.size(), DFA_NO_STATE);
+  std::vector<std::int32_t> queue{blockOf[dfa.start]};
+  id[blockOf[dfa.start]] = 0;
+  for (std::size_t q = 0; q < queue.size(); q++) {
+    const auto rep = blocks[queue[q]].front();
+    std::vector<std::int32_t> row(k);
+    for (std::size_t c = 0; c < k; c++) {
+      const auto b = blockOf[next(rep, c)];
+      if (b == blockOf[dead]) {
+        row[c] = DFA_NO_STATE;
+        continue;
+      }
+      if (id[b] == DFA_NO_STATE) {
+        id[b] = static_cast<std::int32_t>(queue.size());
+        queue.push_back(b);
+      }
+      row[c] = id[b];
+    }
+    result.next.push_back(std::move(row));
+    result.accept.push_back(rep == dead ? DFA_NO_TOKEN : dfa.accept[rep]);
+  }
+  result.start = 0;
+  return result;
+}
+
+TDfa MergeByteClasses(const TDfa& dfa) {
+  TDfa result;
+  result.start = dfa.start;
+  result.accept = dfa.accept;
+  result.next.resize(dfa.next.size());
+  std::map<std::vector<std::int32_t>, std::uint8_t> columns;
+  std::vector<std::uint8_t> merged(dfa.classCount);
+  for (std::size_t c = 0; c < dfa.classCount; c++) {
+    std::vector<std::int32_t> column;
+    for (const auto& row : dfa.next) {
+      column.push_back(row[c]);
+    }
+    auto [it, inserted] = columns.emplace(column, columns.size());
+    merged[c] = it->second;
+    if (inserted) {
+      for (std::size_t s = 0; s < dfa.next.size(); s++) {
+        result.next[s].push_back(column[s]);
+      }
+    }
+  }
+  result.classCount = columns.size();
+  for (unsigned c = 0; c < 256; c++) {
+    result.classOf[c] = merged[dfa.classOf[c]];
+  }
+  return result;
+}
+
+TCombTable PackComb(const TDfa& dfa) {
+  const auto k = static_cast<std::int32_t>(dfa.classCount);
+  TCombTable table;
+  table.base.assign(dfa.next.size(), 0);
+  // densest rows first, they are the hardest to fit
+  std::vector<std::int32_t> rows(dfa.next.size());
+  std::iota(rows.begin(), rows.end(), 0);
+  auto filled = [&](std::int32_t s) {
+    return std::count_if(dfa.next[s].begin(), dfa.next[s].end(), [](auto t) { return t != DFA_NO_STATE; });
+  };
+  std::stable_sort(rows.begin(), rows.end(), [&](auto a, auto b) { return filled(a) > filled(b); });
+  for (auto s : rows) {
+    const auto& row = dfa.next[s];
+    std::int32_t base = 0;
+    auto fits = [&](std::int32_t b) {
+      for (std::int32_t c = 0; c < k; c++) {
+        if (row[c] != DFA_NO_STATE && b + c < static_cast<std::int32_t>(table.check.size()) && table.check[b + c] != DFA_NO_STATE) {
+          return false;
+        }
+      }
+      return true;
+    };
+    while (!fits(base)) {
+      base++;
+    }
+    if (table.check.size() < static_cast<std::size_t>(base + k)) {
+      table.check.resize(base + k, DFA_NO_STATE);
+      table.next.resize(base + k, DFA_NO_STATE);
+    }
+    for (std::int32_t c = 0; c < k; c++) {
+      if (row[c] != DFA_NO_STATE) {
+        table.check[base + c] = s;
+        table.next[base + c] = row[c];
+      }
+    }
+    table.base[s] = base;
+  }
+  return table;
+}
+
+std::pair<std::size_t, std::int32_t> MatchLongest(const TDfa& dfa, std::string_view text) {
+  std::pair<std::size_t, std::int32_t> result{0, DFA_NO_TOKEN};
+  auto state = dfa.start;
+  for (std::size_t i = 0; i < text.size(); i++) {
+    state = dfa.next[state][dfa.classOf[static_cast<unsigned char>(text[i])]];
+    if (state == DFA_NO_STATE) {
+      break;
+    }
+    if (dfa.accept[state] != DFA_NO_TOKEN) {
+      result = {i + 1, dfa.accept[state]};
+    }
+  }
+  return result;
+}
+
+bool CanMatchInside(const TDfa& dfa, std::string_view bytes) {
+  // the states after at least one byte; every state of a minimized DFA
+  // reaches an accepting one
+  std::vector<bool> seen(dfa.next.size());
+  std::vector<std::int32_t> stack;
+  auto visit = [&](std::int32_t state) {
+    if (state != DFA_NO_STATE && !seen[state]) {
+      seen[state] = true;
+      stack.push_back(state);
+    }
+  };
+  for (auto next : dfa.next[dfa.start]) {
+    visit(next);
+  }
+  while (!stack.empty()) {
+    const auto state = stack.back();
+    stack.pop_back();
+    for (auto byte : bytes) {
+      if (dfa.next[state][dfa.classOf[static_cast<unsigned char>(byte)]] != DFA_NO_STATE) {
+        return true;
+      }
+    }
+    for (auto next : dfa.next[state]) {
+      visit(next);
+    }
+  }
+  return false;
+}
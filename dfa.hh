@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Token regexes compiled to a single DFA for the generated lexer (see
+// --dfa_lexer). Supported syntax: literals, `.`, escapes (\d \w \s and their
+// negations, \t \n \r \f \v \xHH, escaped punctuation), classes with ranges,
+// negation and [:name:], groups, `|` and the greedy quantifiers * + ? {m,n}.
+// Anchors, backreferences and lazy quantifiers are rejected.
+//
+// With utf8 the regexes and the input are UTF-8: characters, `.`, classes and
+// their negations stand for code points (written literally or as \uXXXX,
+// \u{X...}), compiled to byte sequences. \d, \w, \s and named classes stay
+// ASCII.
+
+using TByteSet = std::bitset<256>;
+
+constexpr std::int32_t DFA_NO_STATE = -1;
+constexpr std::int32_t DFA_NO_TOKEN = -1;
+
+// next[state][class] with bytes grouped into classes that no regex tells
+// apart; accept[state] is the index of the first regex (in precedence order)
+// accepting there
+struct TDfa {
+  std::array<std::uint8_t, 256> classOf{};
+  std::size_t classCount{0};
+  std::vector<std::vector<std::int32_t>> next;  // DFA_NO_STATE is the dead state
+  std::vector<std::int32_t> accept;
+  std::int32_t start{0};
+};
+
+// Subset construction over the Thompson NFA of all regexes
+TDfa BuildDfa(const std::vector<std::string>& regexes, bool utf8 = false);
+
+// Hopcroft's algorithm: merges states no input can tell apart, drops the
+// unreachable and the dead ones. The start state becomes 0.
+TDfa MinimizeDfa(const TDfa& dfa);
+
+// Merges byte classes that every state treats the same
+TDfa MergeByteClasses(const TDfa& dfa);
+
+// Row displacement ("comb vector") layout of the transitions: next(s, c) is
+// next[base[s] + c] if check[base[s] + c] == s, the dead state otherwise
+struct TCombTable {
+  std::vector<std::int32_t> base;
+  std::vector<std::int32_t> next;
+  std::vector<std::int32_t> check;  // DFA_NO_STATE for free slots
+};
+
+TCombTable PackComb(const TDfa& dfa);
+
+// The longest prefix of text some regex matches and the regex, or {0,
+// DFA_NO_TOKEN}. Empty matches don't count, like in the generated lexer.
+std::pair<std::size_t, std::int32_t> MatchLongest(const TDfa& dfa, std::string_view text);
+
+// Whether a match of the (minimized) DFA can have one of bytes after its
+// first byte. Exact, unlike CanMatchWhitespace: the generated lexer skips
+// whitespace before a token, so only whitespace inside one stops a split.
+bool CanMatchInside(const TDfa& dfa, std::string_view bytes);
@@ -1,13 +1,22 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <map>
+#include <set>
 
 #include <range/v3/view/join.hpp>
 #include <range/v3/view/map.hpp>
 #include <range/v3/view/filter.hpp>
+#include <range/v3/view/enumerate.hpp>
+#include <range/v3/view/take.hpp>
+#include <range/v3/view/drop.hpp>
 #include <range/v3/range/conversion.hpp>
 #include <range/v3/algorithm/equal.hpp>
+#include <range/v3/algorithm/find.hpp>
+#include <range/v3/algorithm/any_of.hpp>
 
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_join.h>
 #include <absl/strings/str_split.h>
 #include <absl/strings/str_format.h>
 #include <absl/strings/substitute.h>
@@ -20,15 +29,472 @@
 #include <cpputils/common.hh>
 
 #include "common.hh"
+#include "dfa.hh"
 
 ABSL_FLAG(std::string, out_dir, "", "output file dir");
 ABSL_FLAG(std::string, grammar_file, "", "file containing the grammar description");
+ABSL_FLAG(bool, elide_eps, false, "don't allocate nodes for EPS alternatives, the parent gets a nullptr child instead");
+ABSL_FLAG(bool, collapse_chains, false, "for alternatives of the form `a: b` return the node of b in place of a");
+ABSL_FLAG(bool, tail_loops, false, "parse tail-recursive nonterminals with a loop instead of recursion");
+ABSL_FLAG(bool, flatten_lists, false, "put all iterations of a tail-recursive nonterminal without actions into a single node");
+ABSL_FLAG(bool, inline_rules, false, "parse small or single-use nonterminals right into the node of the caller when no translation symbol can tell");
+ABSL_FLAG(bool, dfa_lexer, false, "match tokens with a minimal DFA built from their regexes instead of std::regex, see dfa.hh for the supported syntax");
+ABSL_FLAG(bool, utf8, false, "the input is UTF-8 and token regexes match code points rather than bytes, needs --dfa_lexer");
+ABSL_FLAG(bool, recover, false, "emit what EOnError::Recover needs: without it every action runs unguarded and OnError(Recover) throws");
+ABSL_FLAG(int, inline_max_size, 3, "nonterminals with at most this many symbols are inlined even when used more than once");
+ABSL_FLAG(std::string, namespace, "", "put the generated code (and GetVisitor, which the user defines) into this namespace, so that several parsers can be linked together");
 
 extern const char* AST_TEMPLATE;
+extern const char* INLINED_SPANS_TEMPLATE;
+extern const char* EXPAND_INLINED_TEMPLATE;
 extern const char* PARSER_TEMPLATE;
 extern const char* PARSE_METHOD_TEMPLATE;
+extern const char* TAIL_LOOP_METHOD_TEMPLATE;
+extern const char* FLAT_LIST_METHOD_TEMPLATE;
+extern const char* PARSE_TOKENS_TEMPLATE;
+extern const char* SPLIT_PARSE_TOKENS_TEMPLATE;
 extern const char* MAIN_TEMPLATE;
 
+/******************************************************************************
+*                           Parsing method emitters                          *
+******************************************************************************/
+
+// The spelling of what differs between the parse methods of TBasicParser and
+// the coroutines of TCoParser, which await every call and every token
+struct TMethodSyntax {
+  const char* result;
+  const char* prefix;
+  const char* call;
+  const char* ret;
+  const char* peek;
+  const char* next;
+};
+
+constexpr TMethodSyntax PLAIN_METHODS{"TPtr", "Parse_", "", "return", "lexer->Peek()", "lexer->NextToken()"};
+constexpr TMethodSyntax COROUTINE_METHODS{"TParseTask", "CoParse_", "co_await ", "co_return", "(co_await Peek())", "lexer->Consume()"};
+
+struct TEmitOptions {
+  bool elideEps;
+  bool collapseChains;
+  bool tailLoops;
+  bool flattenLists;
+  bool recover;
+  std::vector<std::string> tableNterms;  // see TableNterms
+  const TMethodSyntax* syntax{&PLAIN_METHODS};
+};
+
+// A call of the parse method of nterm
+std::string Call(const TEmitOptions& opts, std::string_view nterm, std::string_view parent) {
+  return absl::StrFormat("%s%s%s(%s)", opts.syntax->call, opts.syntax->prefix, nterm, parent);
+}
+
+// Tokens that select `rhs` among the alternatives of `lhs`
+std::unordered_set<std::string> Predict(TGrammar& grammar, const std::string& lhs, const std::vector<std::string>& rhs) {
+  auto first1 = CalculateRecurFIRST(grammar, rhs);
+  static_assert(!std::is_reference_v<decltype(first1)>, "shouldn't be a reference");
+  if (first1.contains("EPS")) {
+    for (const auto& tok : grammar.follow[lhs]) {
+      first1.insert(tok);
+    }
+  }
+  first1.erase("EPS");
+  return first1;
+}
+
+// Nonterminals in the order of the PUSH_* tables
+std::vector<std::string> TableNterms(TGrammar& grammar) {
+  return grammar.rules | ranges::views::keys | ranges::to<std::set<std::string>>() | ranges::to<std::vector<std::string>>();
+}
+
+std::size_t TableIndex(const std::vector<std::string>& nterms, const std::string& nterm) {
+  return std::lower_bound(nterms.begin(), nterms.end(), nterm) - nterms.begin();
+}
+
+std::string CaseLabels(const std::unordered_set<std::string>& tokens, std::string_view indent) {
+  return tokens
+    | ranges::views::transform([indent] (std::string_view s) { return absl::StrFormat("%scase EToken::%s:", indent, s); })
+    | ranges::views::join(std::string{"\n"})
+    | ranges::to<std::string>();
+}
+
+std::string TokenCondition(const std::unordered_set<std::string>& tokens) {
+  return tokens
+    | ranges::views::transform([] (std::string_view s) { return absl::StrFormat("tokType == EToken::%s", s); })
+    | ranges::views::join(std::string{" || "})
+    | ranges::to<std::string>();
+}
+
+bool IsEpsRhs(const std::vector<std::string>& rhs) {
+  return ranges::equal(rhs, ranges::views::single("EPS"));
+}
+
+bool IsChainRhs(const TGrammar& grammar, const std::vector<std::string>& rhs) {
+  return rhs.size() == 1 && IS_NTERM(rhs.front()) && !grammar.synthetic.contains(rhs.front()) && !grammar.inlined.contains(rhs.front());
+}
+
+bool HasTranslationSymbols(const std::vector<std::vector<std::string>>& rhsGroup) {
+  return ranges::any_of(rhsGroup, [] (const auto& rhs) { return ranges::any_of(rhs, IS_TS); });
+}
+
+// Alternatives handled before a node is allocated: returns the expression that
+// replaces the node for them, or "" if the alternative needs a node
+std::string EarlyResult(const TGrammar& grammar, const std::vector<std::string>& rhs, const TEmitOptions& opts, std::string_view parent) {
+  if (IsEpsRhs(rhs) && opts.elideEps) {
+    return "nullptr";
+  }
+  if (IsChainRhs(grammar, rhs) && opts.collapseChains) {
+    return Call(opts, rhs.front(), parent);
+  }
+  return "";
+}
+
+// Index of the recursive reference to `lhs` in a tail-recursive alternative,
+// or rhs.size() if the alternative doesn't refer to lhs
+std::size_t TailCallPosition(const std::string& lhs, const std::vector<std::string>& rhs) {
+  return ranges::find(rhs, lhs) - rhs.begin();
+}
+
+std::string EmitInline(TGrammar& grammar, const std::string& nterm, const TEmitOptions& opts, std::string_view indent);
+
+// Throws, or after panic-mode recovery (see EOnError) runs `retry` to parse
+// `nterm` again or `leave` to stop parsing it, or returns nullptr at once
+std::string UnexpectedTokenCase(TGrammar& grammar, const std::string& nterm, const std::string& owner, const TEmitOptions& opts, std::string_view indent, std::string_view retry, std::initializer_list<std::string_view> leave) {
+  return utils::Replace(R"({{i}}default:
+{{i}}  if (Recover("Parse_{{owner}}", {{index}})) {
+{{i}}    {{retry}}
+{{i}}  }
+{{i}}  if (stopped) {
+{{i}}    {{return}} nullptr;
+{{i}}  }
+{{i}}  {{leave}})", {
+      {"{{i}}", indent},
+      {"{{owner}}", owner},
+      {"{{index}}", std::to_string(TableIndex(opts.tableNterms, nterm))},
+      {"{{retry}}", retry},
+      {"{{return}}", opts.syntax->ret},
+      {"{{leave}}", absl::StrJoin(leave, absl::StrCat("\n", indent, "  "))},
+  });
+}
+
+// Runs the action of a translation symbol on node `r`, or leaves it for later
+// as EActions says. With --recover none of that happens after an error: the
+// tree is partial and so would be the children the actions depend on.
+std::string EmitAction(TGrammar& grammar, std::string_view symbol, const TEmitOptions& opts, std::string_view indent) {
+  if (opts.recover) {
+    auto unguarded = opts;
+    unguarded.recover = false;
+    return absl::StrFormat("%sif (!failed) {\n%s\n%s}", indent, EmitAction(grammar, symbol, unguarded, absl::StrCat(indent, "  ")), indent);
+  }
+  std::string_view withoutDollar = symbol.substr(1);
+  std::string code = "";
+  if (!grammar.depends.empty()) {
+    code.append(absl::StrFormat(
+        "%sif (actions == EActions::Lazy) {\n%s  static_cast<TLazyTree*>(r.get())->pending.push_back({static_cast<std::uint32_t>(r->children.size()), EAction::%s});\n%s} else ",
+        indent, indent, withoutDollar, indent));
+  }
+  if (grammar.pure.contains(std::string{symbol})) {
+    code.append(absl::StrFormat(
+        "%sif (actions == EActions::DeferPure) {\n%s  static_cast<TLazyTree*>(r.get())->deferred = EPureAction::%s;\n%s} else ",
+        code.empty() ? indent : "", indent, withoutDollar, indent));
+  }
+  if (code.empty()) {
+    return absl::StrFormat("%svisitor->visit_%s(r.get());", indent, withoutDollar);
+  }
+  return absl::StrFormat("%s{\n%s  visitor->visit_%s(r.get());\n%s}", code, indent, withoutDollar, indent);
+}
+
+// Whether the lexer interns the token into a TSymbolTable
+bool IsInterned(const TGrammar& grammar, std::string_view token) {
+  auto it = grammar.tokenValue.find(std::string{token});
+  return it != grammar.tokenValue.end() && it->second == "TSymbol";
+}
+
+// The code that parses a single item of the right hand side into node `r`
+std::string EmitItem(TGrammar& grammar, std::string_view rhsItem, const TEmitOptions& opts, std::string_view indent) {
+  if (IS_TS(rhsItem)) {
+    return EmitAction(grammar, rhsItem, opts, indent);
+  } else if (grammar.synthetic.contains(std::string{rhsItem})) {
+    return EmitInline(grammar, std::string{rhsItem}, opts, indent);
+  } else if (grammar.inlined.contains(std::string{rhsItem})) {
+    return absl::StrFormat(
+        "%sr->BeginInlined(\"%s\");\n%s\n%sr->EndInlined();",
+        indent, rhsItem, EmitInline(grammar, std::string{rhsItem}, opts, indent), indent);
+  } else if (IS_NTERM(rhsItem)) {
+    // with EOnError::Return the error is passed up like this
+    return absl::StrFormat("%sr->AddChild(%s);\n%sif (stopped) {\n%s  %s nullptr;\n%s}", indent, Call(opts, rhsItem, "r.get()"), indent, indent, opts.syntax->ret, indent);
+  }
+  EXPECT(IS_TOKEN(rhsItem), absl::StrFormat("Can only be token but got %s", rhsItem));
+  return utils::Replace(R"(
+{{i}}{
+{{i}}  const auto& token = {{peek}};
+{{i}}  if (token.type != EToken::{{token}}) {
+{{i}}    if (!Missing("{{token}}")) {
+{{i}}      {{return}} nullptr;
+{{i}}    }
+{{i}}  } else {
+{{i}}    auto child = std::make_shared<TLeaf>();{{name}}{{value}}
+{{i}}    {{next}};
+{{i}}    r->AddChild(child);
+{{i}}  }
+{{i}}})", {
+      {"{{i}}", indent},
+      {"{{peek}}", opts.syntax->peek},
+      {"{{return}}", opts.syntax->ret},
+      {"{{next}}", opts.syntax->next},
+      {"{{token}}", rhsItem},
+      // the leaf of an interned token only keeps its TSymbol
+      {"{{name}}", IsInterned(grammar, rhsItem) ? "" : absl::StrCat("\n", indent, "    child->name = token.text;")},
+      {"{{value}}", grammar.tokenValue.contains(std::string{rhsItem}) ? absl::StrCat("\n", indent, "    child->value = token.value;") : ""},
+  });
+}
+
+std::string EmitItems(TGrammar& grammar, ranges::any_view<std::string, ranges::category::bidirectional | ranges::category::sized> items, const TEmitOptions& opts, std::string_view indent) {
+  return items
+    | ranges::views::transform([&grammar, &opts, indent] (std::string_view rhsItem) { return EmitItem(grammar, rhsItem, opts, indent); })
+    | ranges::views::join(std::string{"\n"})
+    | ranges::to<std::string>();
+}
+
+// Synthetic nonterminals (EBNF operators) and inlined ones become a switch
+// inside a loop, that adds its children straight to the node `r`. Only Star
+// repeats the loop on success; the others go round again only to parse the
+// group after a recovered error.
+std::string EmitInline(TGrammar& grammar, const std::string& nterm, const TEmitOptions& opts, std::string_view indent) {
+  auto it = grammar.synthetic.find(nterm);
+  const bool isLoop = it != grammar.synthetic.end() && it->second.kind == ESynthetic::Star;
+  const std::string& owner = it != grammar.synthetic.end() ? it->second.owner : nterm;
+  const std::string switchIndent = absl::StrCat(indent, "  ");
+  const std::string caseIndent = absl::StrCat(switchIndent, "  ");
+  const std::string bodyIndent = absl::StrCat(switchIndent, "    ");
+  std::string cases = "";
+  for (const auto& rhs : grammar.rules[nterm]) {
+    auto labels = CaseLabels(Predict(grammar, nterm, rhs), caseIndent);
+    if (IsEpsRhs(rhs)) {
+      cases.append(absl::StrFormat("%s\n%sbreak;\n", labels, bodyIndent));
+      continue;
+    }
+    cases.append(absl::StrFormat(
+        "%s {\n%s\n%s%s;\n%s}\n",
+        labels,
+        EmitItems(grammar, rhs | ranges::views::take(TailCallPosition(nterm, rhs)), opts, bodyIndent),
+        bodyIndent,
+        isLoop ? "continue" : "break",
+        caseIndent));
+  }
+  cases.append(UnexpectedTokenCase(grammar, nterm, owner, opts, caseIndent, "continue;", {"break;"}));
+  auto code = absl::StrFormat("%sswitch (%s.type) {\n%s\n%s}", switchIndent, opts.syntax->peek, cases, switchIndent);
+  return absl::StrFormat("%swhile (true) {\n%s\n%s  break;\n%s}", indent, code, indent, indent);
+}
+
+
+std::string EmitEarlyReturns(TGrammar& grammar, const std::string& lhs, const TEmitOptions& opts) {
+  std::string earlyCases = "";
+  for (const auto& rhs : grammar.rules[lhs]) {
+    if (auto result = EarlyResult(grammar, rhs, opts, "par"); !result.empty()) {
+      earlyCases.append(absl::StrFormat("%s\n        %s %s;\n", CaseLabels(Predict(grammar, lhs, rhs), "      "), opts.syntax->ret, result));
+    }
+  }
+  if (earlyCases.empty()) {
+    return "";
+  }
+  return absl::StrFormat(
+      "    // alternatives that don't need a node of their own\n"
+      "    switch (tokType) {\n%s      default:\n        break;\n    }\n",
+      earlyCases);
+}
+
+std::string EmitPlainMethod(TGrammar& grammar, const std::string& lhs, const TEmitOptions& opts) {
+  std::string ruleCases = "";
+  for (const auto& rhs : grammar.rules[lhs]) {
+    if (!EarlyResult(grammar, rhs, opts, "par").empty()) {
+      continue;
+    }
+    std::string caseBody = IsEpsRhs(rhs) ? "" : EmitItems(grammar, rhs, opts, "        ");
+    ruleCases.append(absl::StrFormat("%s {\n%s\n        break;\n      }\n", CaseLabels(Predict(grammar, lhs, rhs), "      "), caseBody));
+  }
+  ruleCases.append(UnexpectedTokenCase(grammar, lhs, lhs, opts, "      ", absl::StrFormat("%s %s;", opts.syntax->ret, Call(opts, lhs, "par")), {"break;"}));
+  return utils::Replace(PARSE_METHOD_TEMPLATE, {
+      {"{{result}}", opts.syntax->result},
+      {"{{prefix}}", opts.syntax->prefix},
+      {"{{peek}}", opts.syntax->peek},
+      {"{{return}}", opts.syntax->ret},
+      {"{{nterm}}", lhs},
+      {"{{early_returns}}", EmitEarlyReturns(grammar, lhs, opts)},
+      {"{{rule_cases}}", ruleCases},
+  });
+}
+
+// The recursion is unrolled: the loop goes down creating one node per
+// iteration, then the nodes are linked bottom-up while running the actions
+// that follow the recursive call
+std::string EmitTailLoopMethod(TGrammar& grammar, const std::string& lhs, const TEmitOptions& opts) {
+  std::string earlyExits = "";
+  std::string ruleCases = "";
+  std::string trailingCases = "";
+  for (const auto& [alternative, rhs] : ranges::views::enumerate(grammar.rules[lhs])) {
+    auto predict = Predict(grammar, lhs, rhs);
+    if (auto result = EarlyResult(grammar, rhs, opts, "parent"); !result.empty()) {
+      earlyExits.append(absl::StrFormat("      if (%s) {\n        last = %s;\n        break;\n      }\n", TokenCondition(predict), result));
+      continue;
+    }
+    auto tailCall = TailCallPosition(lhs, rhs);
+    if (tailCall == rhs.size()) {
+      std::string caseBody = IsEpsRhs(rhs) ? "" : EmitItems(grammar, rhs, opts, "          ");
+      ruleCases.append(absl::StrFormat("%s {\n%s\n          break;\n        }\n", CaseLabels(predict, "        "), caseBody));
+      continue;
+    }
+    ruleCases.append(absl::StrFormat(
+        "%s {\n%s\n          frames.emplace_back(r, %d);\n          parent = r.get();\n          continue;\n        }\n",
+        CaseLabels(predict, "        "),
+        EmitItems(grammar, rhs | ranges::views::take(tailCall), opts, "          "),
+        alternative));
+    if (tailCall + 1 < rhs.size()) {
+      trailingCases.append(absl::StrFormat(
+          "        case %d: {\n%s\n          break;\n        }\n",
+          alternative,
+          EmitItems(grammar, rhs | ranges::views::drop(tailCall + 1), opts, "          ")));
+    }
+  }
+  ruleCases.append(UnexpectedTokenCase(grammar, lhs, lhs, opts, "        ", "continue;", {"break;"}));
+  std::string unwindActions = "";
+  if (!trailingCases.empty()) {
+    unwindActions = absl::StrFormat("      switch (alternative) {\n%s      }\n", trailingCases);
+  }
+  return utils::Replace(TAIL_LOOP_METHOD_TEMPLATE, {
+      {"{{result}}", opts.syntax->result},
+      {"{{prefix}}", opts.syntax->prefix},
+      {"{{peek}}", opts.syntax->peek},
+      {"{{return}}", opts.syntax->ret},
+      {"{{nterm}}", lhs},
+      {"{{early_exits}}", earlyExits},
+      {"{{rule_cases}}", ruleCases},
+      {"{{unwind_actions}}", unwindActions},
+  });
+}
+
+// Without actions nobody can tell the iterations apart, so their children are
+// all added to a single node
+std::string EmitFlatListMethod(TGrammar& grammar, const std::string& lhs, const TEmitOptions& opts) {
+  std::string ruleCases = "";
+  for (const auto& rhs : grammar.rules[lhs]) {
+    auto tailCall = TailCallPosition(lhs, rhs);
+    std::string caseBody = IsEpsRhs(rhs) ? "" : EmitItems(grammar, rhs | ranges::views::take(tailCall), opts, "          ");
+    ruleCases.append(absl::StrFormat(
+        "%s {\n%s\n%s          break;\n        }\n",
+        CaseLabels(Predict(grammar, lhs, rhs), "        "),
+        caseBody,
+        tailCall == rhs.size() ? "          more = false;\n" : ""));
+  }
+  ruleCases.append(UnexpectedTokenCase(grammar, lhs, lhs, opts, "        ", "continue;", {"more = false;", "break;"}));
+  return utils::Replace(FLAT_LIST_METHOD_TEMPLATE, {
+      {"{{result}}", opts.syntax->result},
+      {"{{prefix}}", opts.syntax->prefix},
+      {"{{peek}}", opts.syntax->peek},
+      {"{{return}}", opts.syntax->ret},
+      {"{{nterm}}", lhs},
+      {"{{early_returns}}", EmitEarlyReturns(grammar, lhs, opts)},
+      {"{{rule_cases}}", ruleCases},
+  });
+}
+
+/******************************************************************************
+*                              Push parser tables                            *
+******************************************************************************/
+
+// PUSH_* tables of the generated TPushParser. They make the same choices as the
+// parse methods emitted with `opts`, so both build the same trees.
+struct TPushTables {
+  std::string nterms;
+  std::string owners;
+  std::uint16_t start;
+  std::string rules;
+  std::string items;
+  std::string table;
+  std::string follow;
+};
+
+TPushTables EmitPushTables(TGrammar& grammar, const TEmitOptions& opts, const std::vector<std::string>& tokenOrder) {
+  const auto& nterms = opts.tableNterms;
+  std::unordered_map<std::string, std::size_t> ntermIndex;
+  for (const auto& [i, nterm] : ranges::views::enumerate(nterms)) {
+    ntermIndex[nterm] = i;
+  }
+  auto flattened = [&] (const std::string& nterm) {
+    return opts.tailLoops && opts.flattenLists && !grammar.synthetic.contains(nterm) && !grammar.inlined.contains(nterm)
+      && grammar.IsTailRecursive(nterm) && !HasTranslationSymbols(grammar.rules.at(nterm));
+  };
+
+  std::vector<std::string> rules;
+  std::vector<std::string> items;
+  std::vector<std::vector<std::string>> table(nterms.size(), std::vector<std::string>(tokenOrder.size(), "PUSH_NO_RULE"));
+  for (const auto& lhs : nterms) {
+    for (const auto& rhs : grammar.rules.at(lhs)) {
+      const char* kind = "Plain";
+      if (IsEpsRhs(rhs) && opts.elideEps) {
+        kind = "Elided";
+      } else if (IsChainRhs(grammar, rhs) && opts.collapseChains) {
+        kind = "Collapsed";
+      }
+      const auto begin = items.size();
+      for (const auto& symbol : rhs) {
+        if (symbol == "EPS") {
+          continue;
+        } else if (IS_TS(symbol)) {
+          items.push_back(absl::StrFormat("{EPushItem::Action, static_cast<std::uint16_t>(EAction::%s)}", symbol.substr(1)));
+        } else if (IS_TOKEN(symbol)) {
+          items.push_back(absl::StrFormat("{EPushItem::Token, static_cast<std::uint16_t>(EToken::%s)}", symbol));
+        } else {
+          const char* itemKind = grammar.synthetic.contains(symbol) || (symbol == lhs && flattened(lhs)) ? "Inline"
+            : grammar.inlined.contains(symbol) ? "Inlined"
+            : "Node";
+          items.push_back(absl::StrFormat("{EPushItem::%s, %d}  /* %s */", itemKind, ntermIndex.at(symbol), symbol));
+        }
+      }
+      EXPECT(items.size() <= UINT16_MAX && rules.size() < INT16_MAX, "The grammar is too big for the push parser tables");
+      for (const auto& token : Predict(grammar, lhs, rhs)) {
+        const auto column = ranges::find(tokenOrder, token) - tokenOrder.begin();
+        table[ntermIndex.at(lhs)][column] = std::to_string(rules.size());
+      }
+      rules.push_back(absl::StrFormat("{EPushRule::%s, %d, %d}", kind, begin, items.size() - begin));
+    }
+  }
+
+  auto quoted = [] (const auto& names) {
+    return names
+      | ranges::views::transform([] (const std::string& name) { return absl::StrFormat("\"%s\"", name); })
+      | ranges::views::join(std::string{", "})
+      | ranges::to<std::string>();
+  };
+  auto owners = nterms
+    | ranges::views::transform([&grammar] (const std::string& nterm) {
+        auto it = grammar.synthetic.find(nterm);
+        return it != grammar.synthetic.end() ? it->second.owner : nterm;
+      })
+    | ranges::to<std::vector<std::string>>();
+  auto rows = table
+    | ranges::views::enumerate
+    | ranges::views::transform([&nterms] (const auto& row) {
+        return absl::StrFormat("{%s},  // %s", absl::StrJoin(row.second, ", "), nterms[row.first]);
+      })
+    | ranges::to<std::vector<std::string>>();
+  auto follow = nterms
+    | ranges::views::transform([&grammar, &tokenOrder] (const std::string& nterm) {
+        auto row = tokenOrder
+          | ranges::views::transform([&] (const std::string& token) { return grammar.follow[nterm].contains(token) ? "1" : "0"; });
+        return absl::StrFormat("{%s},  // %s", absl::StrJoin(row, ", "), nterm);
+      })
+    | ranges::to<std::vector<std::string>>();
+  return {
+    .nterms = quoted(nterms),
+    .owners = quoted(owners),
+    .start = static_cast<std::uint16_t>(ntermIndex.at("start")),
+    .rules = absl::StrJoin(rules, ",\n  "),
+    .items = absl::StrJoin(items, ",\n  "),
+    .table = absl::StrJoin(rows, "\n  "),
+    .follow = absl::StrJoin(follow, "\n  "),
+  };
+}
+
 std::string ReadFile(std::istream& in) {
   char buf[1024];
   std::string result;
@@ -66,6 +532,30 @@ int main(int argc, char** argv) {
   }
 
   auto outDir = absl::GetFlag(FLAGS_out_dir);
+  const auto ns = absl::GetFlag(FLAGS_namespace);
+  const auto namespaceBegin = ns.empty() ? "" : absl::StrFormat("\nnamespace %s {\n", ns);
+  const auto namespaceEnd = ns.empty() ? "" : absl::StrFormat("\n}  // namespace %s\n", ns);
+
+  // everything that changes the shape of generated trees, goes into the fingerprint
+  const bool elideEps = absl::GetFlag(FLAGS_elide_eps);
+  const bool collapseChains = absl::GetFlag(FLAGS_collapse_chains);
+  const bool flattenLists = absl::GetFlag(FLAGS_flatten_lists);
+  if (absl::GetFlag(FLAGS_inline_rules)) {
+    grammar->inlined = grammar->FindInlinable(absl::GetFlag(FLAGS_inline_max_size));
+    if (grammar->split) {
+      grammar->inlined.erase(grammar->split->item);  // ParseTokens calls its method
+    }
+    for (const auto& nterm : grammar->inlined) {
+      LOG(INFO) << "Inlining " << nterm;
+    }
+  }
+  auto inlined = grammar->inlined | ranges::to<std::set<std::string>>() | ranges::views::join(',') | ranges::to<std::string>();
+  // the DFA lexer picks the longest alternative of `|` where std::regex takes
+  // the first one that matches, so it can lex the same input differently
+  const bool dfaLexer = absl::GetFlag(FLAGS_dfa_lexer);
+  const bool utf8 = absl::GetFlag(FLAGS_utf8);
+  EXPECT(!utf8 || dfaLexer, "--utf8 needs --dfa_lexer");
+  auto shapeOptions = absl::StrFormat("elide_eps=%d collapse_chains=%d flatten_lists=%d inlined=%s dfa_lexer=%d utf8=%d", elideEps, collapseChains, flattenLists, inlined, dfaLexer, utf8);
 
   /****************************************************************************
   *                                AST header                                *
@@ -76,20 +566,54 @@ int main(int argc, char** argv) {
     | ranges::views::join
     | ranges::views::join
     | ranges::views::filter(IS_TS)
-    | ranges::views::transform([] (std::string_view str) -> std::string_view { return str.substr(1); });  // remove $
+    | ranges::views::transform([] (std::string_view str) -> std::string_view { return str.substr(1); })  // remove $
+    | ranges::to<std::set<std::string>>();  // `x+` repeats the symbols of x
 
   auto visitorMethods = transSymbols
     | ranges::views::transform([] (std::string_view str) { return absl::StrFormat("virtual void visit_%s(TTree* ctx) = 0;", str); })
     | ranges::views::join(std::string{"\n  "})  // otherwise null-terminator gets added to output
     | ranges::to<std::string>();
-  auto tokens = grammar->tokenToRegex
+  auto pureSymbols = grammar->pure
+    | ranges::views::transform([] (std::string_view str) { return std::string{str.substr(1)}; })
+    | ranges::to<std::set<std::string>>();
+  auto pureActions = pureSymbols
+    | ranges::views::join(std::string{",\n  "})
+    | ranges::to<std::string>();
+  auto batchSymbols = grammar->batch
+    | ranges::views::transform([] (std::string_view str) { return std::string{str.substr(1)}; })
+    | ranges::to<std::set<std::string>>();
+  auto batchMethods = batchSymbols
+    | ranges::views::transform([] (std::string_view str) {
+        return absl::StrFormat(
+            "virtual void visit_%s_batch(const std::vector<TTree*>& nodes) {\n    for (auto node : nodes) {\n      visit_%s(node);\n    }\n  }",
+            str, str);
+      })
+    | ranges::views::join(std::string{"\n\n  "})
+    | ranges::to<std::string>();
+  auto tokenNames = grammar->tokenToRegex
     | ranges::views::keys
+    | ranges::to<std::vector<std::string>>();
+  auto tokens = tokenNames
     | ranges::views::join(std::string{",\n  "})  // otherwise null-terminator gets added to output
     | ranges::to<std::string>();
 
   std::string astHeader = utils::Replace(AST_TEMPLATE, {
     { "{{tokens}}", tokens },
+    // hashed by the compiler, with the HashBytes the cache keys use
+    { "{{grammar_fingerprint}}", absl::StrFormat("\"%s\"", absl::CEscape(absl::StrCat(grammarStr, "\n", shapeOptions))) },
     { "{{visitor_methods}}", visitorMethods },
+    { "{{pure_actions}}", pureActions },
+    { "{{batch_methods}}", batchMethods },
+    { "{{actions}}", transSymbols | ranges::views::join(std::string{",\n  "}) | ranges::to<std::string>() },
+    // without inlined nonterminals trees don't pay for the spans
+    { "{{inlined_spans}}", grammar->inlined.empty()
+        ? "// nothing is parsed inline (see --inline_rules)\n  inline void BeginInlined(const char*) {}\n  inline void EndInlined() {}"
+        : INLINED_SPANS_TEMPLATE },
+    { "{{expand_inlined}}", grammar->inlined.empty()
+        ? "// Nothing is parsed inline (see --inline_rules), so the tree has the shape\n// described by the grammar already\ninline void ExpandInlined(TNode*) {}"
+        : EXPAND_INLINED_TEMPLATE },
+    { "{{namespace_begin}}", namespaceBegin },
+    { "{{namespace_end}}", namespaceEnd },
   });
   {
     std::ofstream out{absl::StrCat(outDir, "/ast.hh")};
@@ -100,76 +624,272 @@ int main(int argc, char** argv) {
   *                          Parser & lexer header                           *
   ****************************************************************************/
 
+  // the DFA lexer needs none of the per-token matchers
+  auto regexMatched = [&grammar, dfaLexer] (const auto& tokId) { return !dfaLexer && !grammar->keywords.contains(tokId); };
   auto tokenToRegex = grammar->tokenPrecedence
+    | ranges::views::filter(regexMatched)
     | ranges::views::transform([&tokenToRegex=grammar->tokenToRegex](const auto& tokId) { return absl::StrFormat(R"({EToken::%s, std::regex{"%s"}})", tokId, tokenToRegex[tokId]); })
     | ranges::views::join(std::string{",\n    "})
     | ranges::to<std::string>();
 
-  std::string parsingMethods = "";
-  for (const auto& [lhs, rhsGroup] : grammar->rules) {
-
-    std::string ruleCases = "";
-    for (const auto& rhs : rhsGroup) {
-      auto first1 = CalculateRecurFIRST(*grammar, rhs);
-      static_assert(!std::is_reference_v<decltype(first1)>, "shouldn't be a reference");
-      if (first1.contains("EPS")) {
-        for (const auto& tok : grammar->follow[lhs]) {
-          first1.insert(tok);
+  auto tokenClasses = grammar->tokenPrecedence
+    | ranges::views::filter(regexMatched)
+    | ranges::views::transform([&grammar] (const auto& tokId) {
+        auto run = CharClassRun(grammar->tokenToRegex.at(tokId));
+        if (!run) {
+          return std::string{"{0, {}}"};
         }
+        auto ranges = *run
+          | ranges::views::transform([] (const auto& range) {
+              return absl::StrFormat("{'%s', '%s'}", absl::CEscape(std::string(1, range.first)), absl::CEscape(std::string(1, range.second)));
+            })
+          | ranges::to<std::vector<std::string>>();
+        return absl::StrFormat("{%d, {%s}}", ranges.size(), absl::StrJoin(ranges, ", "));
+      })
+    | ranges::views::join(std::string{",\n    "})
+    | ranges::to<std::string>();
+
+  auto tokenLiterals = grammar->tokenPrecedence
+    | ranges::views::filter(regexMatched)
+    | ranges::views::transform([&grammar] (const auto& tokId) {
+        return absl::StrFormat("\"%s\"", absl::CEscape(RegexLiteral(grammar->tokenToRegex.at(tokId)).value_or("")));
+      })
+    | ranges::views::join(std::string{",\n    "})
+    | ranges::to<std::string>();
+
+  auto joinNumbers = [] (const auto& numbers) {
+    return numbers
+      | ranges::views::transform([] (auto n) { return n == DFA_NO_STATE ? std::string{"DFA_DEAD"} : std::to_string(n); })
+      | ranges::views::join(std::string{", "})
+      | ranges::to<std::string>();
+  };
+  std::string dfaByteClass = absl::StrJoin(std::vector<int>(256, 0), ", ");
+  std::string dfaBase = "0";
+  std::string dfaNext = "DFA_DEAD";
+  std::string dfaCheck = "DFA_DEAD";
+  std::string dfaAccept = "EToken::EPS";
+  if (dfaLexer) {
+    const auto regexes = grammar->tokenPrecedence
+      | ranges::views::transform([&grammar] (const auto& tokId) { return grammar->tokenToRegex.at(tokId); })
+      | ranges::to<std::vector<std::string>>();
+    const auto subsets = BuildDfa(regexes, utf8);
+    const auto dfa = MergeByteClasses(MinimizeDfa(subsets));
+    EXPECT(dfa.next.size() < UINT16_MAX, absl::StrFormat("The token DFA has too many states: %d", dfa.next.size()));
+    const auto comb = PackComb(dfa);
+    dfaByteClass = absl::StrJoin(std::vector<int>(dfa.classOf.begin(), dfa.classOf.end()), ", ");
+    dfaBase = joinNumbers(comb.base);
+    dfaNext = joinNumbers(comb.next);
+    dfaCheck = joinNumbers(comb.check);
+    dfaAccept = dfa.accept
+      | ranges::views::transform([&grammar] (auto token) {
+          return absl::StrCat("EToken::", token == DFA_NO_TOKEN ? "EPS" : grammar->tokenPrecedence[token]);
+        })
+      | ranges::views::join(std::string{", "})
+      | ranges::to<std::string>();
+    const auto states = dfa.next.size();
+    LOG(INFO) << absl::StrFormat(
+        "Token DFA: %d states (%d before minimization), %d byte classes; comb table of %d entries, %d bytes in all "
+        "(a dense table would take %d bytes over byte classes, %d over bytes)",
+        states, subsets.next.size(), dfa.classCount, comb.next.size(),
+        256 + 2 * states + 4 * comb.next.size() + sizeof(int) * states,  // EToken is an int
+        2 * states * dfa.classCount, 2 * states * 256);
+  }
+
+  TEmitOptions opts{
+    .elideEps = elideEps,
+    .collapseChains = collapseChains,
+    .tailLoops = absl::GetFlag(FLAGS_tail_loops),
+    .flattenLists = flattenLists,
+    .recover = absl::GetFlag(FLAGS_recover),
+    .tableNterms = TableNterms(*grammar),
+  };
+  auto emitMethods = [&grammar] (const TEmitOptions& methodOpts) {
+    std::string methods = "";
+    for (const auto& [lhs, rhsGroup] : grammar->rules) {
+      if (grammar->synthetic.contains(lhs) || grammar->inlined.contains(lhs)) {
+        continue;  // parsed inline by the caller
       }
-      first1.erase("EPS");
-
-      auto cases = first1
-        | ranges::views::transform([] (std::string_view s) { return absl::StrFormat("      case EToken::%s:", s); })
-        | ranges::views::join(std::string{"\n"})
-        | ranges::to<std::string>();
-
-      std::string caseBody;
-      if (!ranges::equal(rhs, ranges::views::single("EPS"))) {
-        caseBody = rhs
-          | ranges::views::transform([] (std::string_view rhsItem) {
-              if (IS_TS(rhsItem)) {
-                std::string_view withoutDollar = rhsItem.substr(1);
-                return absl::StrFormat("        visitor->visit_%s(r.get());", withoutDollar);
-              } else if (IS_NTERM(rhsItem)) {
-                return absl::StrFormat("        r->AddChild(Parse_%s(r.get()));", rhsItem);
-              } else {
-                EXPECT(IS_TOKEN(rhsItem), absl::StrFormat("Can only be token but got %s", rhsItem));
-                return absl::StrFormat(
-        R"(
-        {
-          auto [type, localTok] = lexer->Peek();
-          assert(type == EToken::%s);
-          lexer->NextToken();
-          auto child = std::make_shared<TLeaf>();
-          child->name = localTok;
-          r->AddChild(child);
-        })",
-                    rhsItem);
-              }
-          })
-          | ranges::views::join(std::string{"\n"})
-          | ranges::to<std::string>();
+      std::string method;
+      if (methodOpts.tailLoops && grammar->IsTailRecursive(lhs)) {
+        method = methodOpts.flattenLists && !HasTranslationSymbols(rhsGroup)
+          ? EmitFlatListMethod(*grammar, lhs, methodOpts)
+          : EmitTailLoopMethod(*grammar, lhs, methodOpts);
+      } else {
+        method = EmitPlainMethod(*grammar, lhs, methodOpts);
       }
-      ruleCases.append(absl::StrFormat("%s {\n%s\n        break;\n      }\n", cases, caseBody));
-    }
-    ruleCases.append(
-      absl::StrFormat(
-        R"(      default: throw std::runtime_error("Unexpected " + tok + " at Parse_%s");)",
-        lhs
-      )
-    );
-    std::string method = utils::Replace(PARSE_METHOD_TEMPLATE, {
-        {"{{nterm}}", lhs},
-        {"{{rule_cases}}", ruleCases},
-    });
-    parsingMethods.append("\n").append(method);
+      methods.append("\n").append(method);
+    }
+    return methods;
+  };
+  const std::string parsingMethods = emitMethods(opts);
+  auto coroutineOpts = opts;
+  coroutineOpts.syntax = &COROUTINE_METHODS;
+  const std::string coroutineMethods = emitMethods(coroutineOpts);
+
+  // EToken order: the two reserved ones, then the enumerators of ast.hh
+  std::vector<std::string> tokenOrder{"MY_EOF", "EPS"};
+  tokenOrder.insert(tokenOrder.end(), tokenNames.begin(), tokenNames.end());
+  const auto push = EmitPushTables(*grammar, opts, tokenOrder);
+
+  bool splitsAtWhitespace = true;
+  for (const auto& [token, regex] : grammar->tokenToRegex) {
+    bool inside;
+    try {
+      inside = CanMatchInside(MinimizeDfa(BuildDfa({regex}, utf8)), " \t\n");
+    } catch (const std::runtime_error&) {
+      // syntax the DFA doesn't know, e.g. a lookahead
+      inside = CanMatchWhitespace(regex);
+    }
+    if (inside) {
+      LOG(INFO) << token << " may contain whitespace, LexParallel will lex on one thread";
+      splitsAtWhitespace = false;
+    }
+  }
+
+  auto runPureCases = pureSymbols
+    | ranges::views::transform([] (std::string_view str) {
+        return absl::StrFormat("case EPureAction::%s:\n      visitor.visit_%s(node);\n      break;", str, str);
+      })
+    | ranges::views::join(std::string{"\n    "})
+    | ranges::to<std::string>();
+
+  // DEPENDS and DEPENDS_BEGIN, by EAction
+  std::vector<std::string> depends;
+  std::vector<std::string> dependsBegin;
+  for (const auto& symbol : transSymbols) {
+    dependsBegin.push_back(std::to_string(depends.size()));
+    if (auto it = grammar->depends.find(absl::StrCat("$", symbol)); it != grammar->depends.end()) {
+      for (const auto& dep : it->second) {
+        if (dep == "parent") {
+          depends.push_back("{EDependency::Parent, 0}");
+          continue;
+        }
+        auto [fromAction, offset] = DependencyIndex(*grammar, absl::StrCat("$", symbol), dep);
+        depends.push_back(absl::StrFormat("{EDependency::%s, %d}", fromAction ? "Back" : "Front", offset));
+      }
+    }
+  }
+  dependsBegin.push_back(std::to_string(depends.size()));
+
+  auto runActionCases = transSymbols
+    | ranges::views::transform([] (std::string_view str) {
+        return absl::StrFormat("case EAction::%s:\n      visitor.visit_%s(node);\n      break;", str, str);
+      })
+    | ranges::views::join(std::string{"\n    "})
+    | ranges::to<std::string>();
+  std::string pureAction = "return EPureAction::NONE;";
+  if (!pureSymbols.empty()) {
+    pureAction = absl::StrCat(
+        "switch (action) {\n",
+        pureSymbols
+          | ranges::views::transform([] (std::string_view str) { return absl::StrFormat("    case EAction::%s:\n      return EPureAction::%s;\n", str, str); })
+          | ranges::views::join
+          | ranges::to<std::string>(),
+        "    default:\n      return EPureAction::NONE;\n  }");
   }
 
+  std::string isBatched = "return false;";
+  if (!batchSymbols.empty()) {
+    isBatched = absl::StrCat(
+        "switch (action) {\n",
+        batchSymbols
+          | ranges::views::transform([] (std::string_view str) { return absl::StrFormat("    case EAction::%s:\n", str); })
+          | ranges::views::join
+          | ranges::to<std::string>(),
+        "      return true;\n    default:\n      return false;\n  }");
+  }
+  auto runBatchCases = batchSymbols
+    | ranges::views::transform([] (std::string_view str) {
+        return absl::StrFormat("case EAction::%s:\n      visitor.visit_%s_batch(nodes);\n      break;", str, str);
+      })
+    | ranges::views::join(std::string{"\n    "})
+    | ranges::to<std::string>();
+
+  auto tokenValueCases = grammar->tokenValue
+    | ranges::to<std::map<std::string, std::string>>()
+    | ranges::views::transform([] (const auto& tokenType) {
+        const auto& [token, type] = tokenType;
+        if (type == "TSymbol") {
+          return absl::StrFormat("case EToken::%s:\n      return TSymbol{symbols.Intern(text)};", token);
+        }
+        return absl::StrFormat("case EToken::%s:\n      return FromChars<%s>(text, \"%s\");", token, type, token);
+      })
+    | ranges::views::join(std::string{"\n    "})
+    | ranges::to<std::string>();
+
+  std::vector<std::string> keywordTexts;
+  std::vector<std::string> keywordEntries;
+  std::uint16_t rank = 0;
+  for (const auto& token : grammar->tokenPrecedence) {
+    if (auto it = grammar->keywords.find(token); it != grammar->keywords.end()) {
+      keywordTexts.push_back(it->second);
+      keywordEntries.push_back(absl::StrFormat(R"({"%s", EToken::%s, %d})", absl::CEscape(it->second), token, rank));
+    } else {
+      rank++;
+    }
+  }
+  // without keywords the lexer has no table to look them up in
+  const auto keywordHash = keywordTexts.empty() ? TKeywordHash{0, 0} : BuildKeywordHash(keywordTexts);
+  std::vector<std::string> keywordSlots(keywordHash.slotCount, R"({"", EToken::EPS, 0})");
+  for (std::size_t i = 0; i < keywordTexts.size(); i++) {
+    keywordSlots[KeywordHash(keywordTexts[i], keywordHash.seed) & (keywordHash.slotCount - 1)] = keywordEntries[i];
+  }
+
+  std::string parseTokens = PARSE_TOKENS_TEMPLATE;
+  if (grammar->split) {
+    parseTokens = utils::Replace(SPLIT_PARSE_TOKENS_TEMPLATE, {
+        { "{{separator}}", grammar->split->separator},
+        { "{{item}}", grammar->split->item},
+        { "{{item_index}}", std::to_string(TableIndex(opts.tableNterms, grammar->split->item))},
+    });
+  }
 
   std::string parserHeader = utils::Replace(PARSER_TEMPLATE, {
       { "{{token_to_regex}}", tokenToRegex},
+      { "{{token_value_cases}}", tokenValueCases},
+      { "{{token_classes}}", tokenClasses},
+      { "{{token_literals}}", tokenLiterals},
+      { "{{dfa_lexer}}", dfaLexer ? "true" : "false"},
+      { "{{utf8}}", utf8 ? "true" : "false"},
+      { "{{dfa_byte_class}}", dfaByteClass},
+      { "{{dfa_base}}", dfaBase},
+      { "{{dfa_next}}", dfaNext},
+      { "{{dfa_check}}", dfaCheck},
+      { "{{dfa_accept}}", dfaAccept},
+      { "{{keyword_slots}}", std::to_string(keywordHash.slotCount)},
+      { "{{keywords}}", absl::StrJoin(keywordSlots, ",\n  ")},
+      { "{{keyword_seed}}", std::to_string(keywordHash.seed)},
+      { "{{splits_at_whitespace}}", splitsAtWhitespace ? "true" : "false"},
+      { "{{parse_tokens}}", parseTokens},
+      { "{{run_pure_cases}}", runPureCases},
+      { "{{has_depends}}", grammar->depends.empty() ? "false" : "true"},
+      { "{{recover}}", opts.recover ? "true" : "false"},
+      { "{{depends_size}}", std::to_string(depends.size())},
+      { "{{depends}}", absl::StrJoin(depends, ", ")},
+      { "{{depends_begin}}", absl::StrJoin(dependsBegin, ", ")},
+      { "{{is_batched}}", isBatched},
+      { "{{run_batch_cases}}", runBatchCases},
       { "{{parsing_methods}}", parsingMethods},
+      { "{{coroutine_methods}}", coroutineMethods},
+      { "{{token_names}}", tokenOrder
+          | ranges::views::transform([] (const std::string& name) { return absl::StrFormat("\"%s\"", name); })
+          | ranges::views::join(std::string{", "})
+          | ranges::to<std::string>()},
+      { "{{interned_tokens}}", tokenOrder
+          | ranges::views::transform([&grammar] (const std::string& name) { return IsInterned(*grammar, name) ? "true" : "false"; })
+          | ranges::views::join(std::string{", "})
+          | ranges::to<std::string>()},
+      { "{{push_nterms}}", push.nterms},
+      { "{{follow_table}}", push.follow},
+      { "{{push_owners}}", push.owners},
+      { "{{push_start}}", std::to_string(push.start)},
+      { "{{push_rules}}", push.rules},
+      { "{{push_items}}", push.items},
+      { "{{push_table}}", push.table},
+      { "{{run_action_cases}}", runActionCases},
+      { "{{pure_action}}", pureAction},
+      { "{{namespace_begin}}", namespaceBegin},
+      { "{{namespace_end}}", namespaceEnd},
   });
   {
     std::ofstream out{absl::StrCat(outDir, "/parser.hh")};
@@ -179,11 +899,14 @@ int main(int argc, char** argv) {
   if (auto outMain = absl::StrCat(outDir, "/main.cc"); !std::filesystem::exists(outMain)) {
     std::ofstream out{outMain};
     auto visitOverrides = transSymbols
-      | ranges::views::transform([] (std::string_view str) { return absl::StrFormat("void visit_%s(TTree* ctx) override {}", str); })
+      | ranges::views::transform([] (std::string_view str) { return absl::StrFormat("void visit_%s([[maybe_unused]] TTree* ctx) override {}", str); })
       | ranges::views::join(std::string{"\n  "})
       | ranges::to<std::string>();
     out << utils::Replace(MAIN_TEMPLATE, {
         {"{{visit_overrides}}", visitOverrides},
+        {"{{namespace_begin}}", namespaceBegin},
+        {"{{namespace_end}}", namespaceEnd},
+        {"{{namespace_prefix}}", ns.empty() ? "" : absl::StrCat(ns, "::")},
     });
     LOG(INFO) << "No main in out_dir; generated " << outMain;
   }
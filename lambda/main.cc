@@ -1,6 +1,4 @@
 
-#include <fstream>
-
 #include "parser.hh"
 #include "ast.hh"
 
@@ -16,18 +14,5 @@ std::shared_ptr<IVisitor> GetVisitor() {
 }
 
 int main(int argc, char** argv) {
-  std::shared_ptr<std::istream> source;
-  if (argc == 1) {
-    // read from stdin
-    source = std::shared_ptr<std::istream>(&std::cin, [](auto) {});
-    // custom noop deleter for std::cin
-  } else {
-    assert(argc == 2);
-    source = std::make_shared<std::ifstream>(std::string{argv[1]});
-  }
-  auto lexer = std::make_shared<TLexer>(source);
-  auto parser = std::make_shared<TParser>(lexer);
-
-  auto result = parser->Parse();
-  TreeToDot(std::cout, result.get());
+  return RunDriver(argc, argv);
 }
@@ -8,18 +8,15 @@ fi
 
 
 ./debug/generator --grammar_file calculator/grammar --out_dir calculator/
-c++ calculator/main.cc -o calculator/out -std=c++17
+c++ calculator/main.cc -o calculator/out -std=c++17 -pthread
 
-while read -r line
-do
-    echo "Testing '$line'..."
-    if echo "$line" | ./calculator/out >/dev/null; then
-        echo "OK: parser returned 0"
-    else
-        echo "FAIL: parser failed"
-        exit 1
-    fi
-done <./calculator/samples
+# one process for all the samples, prints "<line number>\t<value or error>"
+if ./calculator/out --batch ./calculator/samples; then
+    echo "OK: all samples parsed"
+else
+    echo "FAIL: parser failed"
+    exit 1
+fi
 
 
 echo "Now you can enter a custom expression to parse, I will print the result and draw the AST"
@@ -8,29 +8,22 @@ fi
 
 
 ./debug/generator --grammar_file lambda/grammar --out_dir lambda/
-c++ lambda/main.cc -o lambda/out -std=c++17
-
-while read -r line
-do
-    echo "Testing '$line'..."
-    if echo "$line" | ./lambda/out >/dev/null; then
-        echo "OK: parser returned 0"
-    else
-        echo "FAIL: parser failed"
-        exit 1
-    fi
-done <./lambda/examples
-
-while read -r line
-do
-    echo "Testing '$line'..."
-    if echo "$line" | ./lambda/out >/dev/null; then
-        echo "FAIL: error expected"
-        exit 1
-    else
-        echo "OK: parser failed"
-    fi
-done <./lambda/invalid-examples
+c++ lambda/main.cc -o lambda/out -std=c++17 -pthread
+
+# one process per file, prints "<line number>\t<ok or error>"
+if ./lambda/out --batch ./lambda/examples; then
+    echo "OK: all examples parsed"
+else
+    echo "FAIL: parser failed"
+    exit 1
+fi
+
+if ./lambda/out --batch ./lambda/invalid-examples | cut -f2 | grep -qx ok; then
+    echo "FAIL: error expected"
+    exit 1
+else
+    echo "OK: parser failed on all invalid examples"
+fi
 
 echo "==============================================================="
 echo "==========================SUCCESS=============================="
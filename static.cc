@@ -6,34 +6,113 @@ const char* AST_TEMPLATE = R"(
 #include <string>
 #include <any>
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <string_view>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+{{namespace_begin}}
 enum class EToken {
   MY_EOF,
   EPS,
   {{tokens}}
 };
 
+// 64-bit FNV-1a
+constexpr std::uint64_t HashBytes(std::string_view bytes, std::uint64_t seed = 0xcbf29ce484222325ull) {
+  std::uint64_t h = seed;
+  for (unsigned char c : bytes) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Changes whenever the grammar (or anything else affecting the tree shape) does
+constexpr std::uint64_t GRAMMAR_FINGERPRINT = HashBytes({{grammar_fingerprint}});
+
 struct TNode;
 
 using TPtr = std::shared_ptr<TNode>;
 
 struct TNode {
   TNode* parent;
+  std::uint32_t index{0};  // in parent->children
   std::string name;
   std::any value;
 
   virtual ~TNode() = default;
 };
 
+// Children [begin, end) of a node that belong to a nonterminal parsed inline
+// (see --inline_rules). parent is the index of the enclosing span.
+struct TInlinedSpan {
+  const char* name;
+  std::uint32_t begin;
+  std::uint32_t end;
+  std::uint32_t parent;
+};
+
+constexpr std::uint32_t NO_SPAN = UINT32_MAX;
+
+// %pure translation symbols, for actions left to EvaluatePure by the parser
+enum class EPureAction : std::uint16_t {
+  NONE,
+  {{pure_actions}}
+};
+
+// Translation symbols, for actions left to Demand by a lazy parser
+enum class EAction : std::uint16_t {
+  {{actions}}
+};
+
+// An action reached when its node had `position` children
+struct TPendingAction {
+  std::uint32_t position;
+  EAction action;
+};
+
 struct TTree : TNode {
   std::vector<TPtr> children;
+  {{inlined_spans}}
 
+  // child is nullptr for elided EPS nodes (see --elide_eps)
   inline void AddChild(TPtr child) {
-    children.push_back(child);
-    child->parent = this;
+    if (child != nullptr) {
+      child->parent = this;
+      child->index = static_cast<std::uint32_t>(children.size());
+    }
+    children.push_back(std::move(child));
+  }
+
+  // Takes the subtrees only this node owns apart with an explicit stack: the
+  // default destructor recurses once per level, and a long list parsed by a
+  // tail loop is as deep as it is long.
+  ~TTree() {
+    std::vector<TPtr> stack = std::move(children);
+    while (!stack.empty()) {
+      TPtr node = std::move(stack.back());
+      stack.pop_back();
+      if (auto t = dynamic_cast<TTree*>(node.get()); t != nullptr && node.use_count() == 1) {
+        std::move(t->children.begin(), t->children.end(), std::back_inserter(stack));
+        t->children.clear();
+      }
+    }
   }
+};
 
-  ~TTree() = default;
+// The nodes of a parse that doesn't run every action where it reaches it (see
+// EActions): they keep the actions left for later. An eager parse makes plain
+// TTrees and doesn't pay for these.
+struct TLazyTree : TTree {
+  EPureAction deferred{EPureAction::NONE};
+  std::vector<TPendingAction> pending;
+  std::uint32_t nextPending{0};
 };
 
 struct TLeaf : TNode {
@@ -45,6 +124,10 @@ struct IVisitor {
   // virtual void visit_<translation symbol>(TNode* ctx) = 0;
   {{visitor_methods}}
 
+  // for %batch symbols: all of their pending actions at once, after a lazy
+  // parse (see RunBatches)
+  {{batch_methods}}
+
   static TTree* GetAncestor(TNode* n, int i) {
     if (i <= 0) {
       throw std::runtime_error("Bad index for parent access");
@@ -65,7 +148,7 @@ struct IVisitor {
     if (parent == nullptr) {
       throw std::runtime_error("Can't access parent");
     }
-    if (i < 0 || i >= parent->children.size()) {
+    if (i < 0 || static_cast<std::size_t>(i) >= parent->children.size()) {
       throw std::runtime_error("Can't access brother: index out of range");
     }
     return parent->children[i];
@@ -75,221 +158,2825 @@ struct IVisitor {
 
 std::shared_ptr<IVisitor> GetVisitor();  // user should define this, we provide only the declaration
 
-inline std::size_t TreeToDotHelper(std::ostream& os, const TNode* node,
-                                   std::size_t& id) {
-  std::size_t thisId = ++id;
-  os << "n" << thisId << " [label=\"" << node->name << "\"]\n";
-  const TTree* t = dynamic_cast<const TTree*>(node);
-  if (t == nullptr) {
-    return thisId;
+// What TreeToDot and TreeToBinary write for a node, its name if empty. Leaves
+// of interned tokens have no name of their own, see SymbolNames.
+using TNodeNamer = std::function<std::string_view(const TNode*)>;
+
+inline std::string_view NodeName(const TNodeNamer& namer, const TNode* node) {
+  return namer ? namer(node) : std::string_view{node->name};
+}
+
+// A node of a tree in memory seen the way TNodeView sees a mapped one, so
+// that code walking trees can take either: template it on the view type.
+// Names come from namer if it's set.
+struct TTreeView {
+  TTreeView(const TNode* node, const TNodeNamer* namer = nullptr)
+    : node{node}, tree{dynamic_cast<const TTree*>(node)}, namer{namer} {}
+
+  std::string_view Name() const {
+    return namer != nullptr ? NodeName(*namer, node) : std::string_view{node->name};
+  }
+
+  bool IsLeaf() const {
+    return node != nullptr && tree == nullptr;
+  }
+
+  // an elided EPS node (see --elide_eps)
+  bool IsNull() const {
+    return node == nullptr;
+  }
+
+  std::size_t ChildCount() const {
+    return tree != nullptr ? tree->children.size() : 0;
+  }
+
+  TTreeView Child(std::size_t i) const {
+    if (i >= ChildCount()) {
+      throw std::runtime_error("Can't access child: index out of range");
+    }
+    return {tree->children[i].get(), namer};
   }
-  for (auto& child : t->children) {
-    auto childId = TreeToDotHelper(os, child.get(), id);
-    os << "n" << thisId << " -> "
-       << "n" << childId << "\n";
+
+  const TNode* node;
+  const TTree* tree;  // nullptr for a leaf
+  const TNodeNamer* namer;
+};
+
+// Nodes are numbered in pre-order, and the edge to a child is written after
+// its subtree. The walk keeps its own stack, trees can be very deep. TView is
+// TTreeView or TNodeView.
+template <class TView>
+void TreeToDotHelper(std::ostream& os, TView root) {
+  struct TFrame {
+    TView node;
+    std::size_t id;
+    std::size_t next;  // child
+  };
+  std::vector<TFrame> stack;
+  std::size_t id = 0;
+  auto enter = [&](TView node) {
+    os << "n" << ++id << " [label=\"" << node.Name() << "\"]\n";
+    stack.push_back({node, id, 0});
+  };
+  enter(root);
+  while (!stack.empty()) {
+    auto& frame = stack.back();
+    if (frame.next == frame.node.ChildCount()) {
+      const auto childId = frame.id;
+      stack.pop_back();
+      if (!stack.empty()) {
+        os << "n" << stack.back().id << " -> "
+           << "n" << childId << "\n";
+      }
+      continue;
+    }
+    if (auto child = frame.node.Child(frame.next++); !child.IsNull()) {
+      enter(child);
+    }
   }
-  return thisId;
 }
 
-inline void TreeToDot(std::ostream& os, const TNode* node) {
+inline void TreeToDot(std::ostream& os, const TNode* node, const TNodeNamer& namer = {}) {
   os << "strict digraph {\n";
-  std::size_t id = 0;
-  TreeToDotHelper(os, node, id);
+  TreeToDotHelper(os, TTreeView{node, namer ? &namer : nullptr});
   os << "}\n";
 }
-)";
+
+{{expand_inlined}}
+
+// Binary tree format: a header, then all nodes in BFS order (so the children of
+// every node are stored contiguously), then the pool of node names. Node values
+// are not serialized.
+constexpr std::uint32_t TREE_MAGIC = 0x45525454;  // "TTRE" when little-endian
+constexpr std::uint32_t TREE_FORMAT_VERSION = 1;
+constexpr std::uint32_t PACKED_LEAF = UINT32_MAX;
+constexpr std::uint32_t PACKED_NULL = UINT32_MAX - 1;
+
+struct TPackedHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t nodeCount;
+  std::uint32_t namesSize;
+};
+
+struct TPackedNode {
+  std::uint32_t nameOffset;
+  std::uint32_t nameSize;
+  std::uint32_t firstChild;
+  std::uint32_t childCount;  // PACKED_LEAF for TLeaf, PACKED_NULL for an elided child
+};
+
+inline void TreeToBinary(std::ostream& os, const TNode* root, const TNodeNamer& namer = {}) {
+  std::vector<const TNode*> order{root};
+  std::vector<TPackedNode> nodes;
+  std::string names;
+  for (std::size_t i = 0; i < order.size(); i++) {
+    const TNode* node = order[i];
+    if (node == nullptr) {
+      nodes.push_back({0, 0, 0, PACKED_NULL});
+      continue;
+    }
+    const auto name = NodeName(namer, node);
+    TPackedNode packed{
+      static_cast<std::uint32_t>(names.size()),
+      static_cast<std::uint32_t>(name.size()),
+      0,
+      PACKED_LEAF,
+    };
+    names += name;
+    if (auto t = dynamic_cast<const TTree*>(node); t != nullptr) {
+      packed.firstChild = static_cast<std::uint32_t>(order.size());
+      packed.childCount = static_cast<std::uint32_t>(t->children.size());
+      for (auto& child : t->children) {
+        order.push_back(child.get());
+      }
+    }
+    nodes.push_back(packed);
+  }
+  TPackedHeader header{
+    TREE_MAGIC,
+    TREE_FORMAT_VERSION,
+    static_cast<std::uint32_t>(nodes.size()),
+    static_cast<std::uint32_t>(names.size()),
+  };
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(TPackedNode));
+  os.write(names.data(), names.size());
+}
+
+// Read-only view of a node inside a mapped tree. It's a pair of pointers and an
+// index, so pass it by value. Its members are those of TTreeView; values
+// aren't in the file.
+struct TNodeView {
+  const TPackedNode* nodes;
+  const char* names;
+  std::uint32_t nodeCount;
+  std::uint32_t index;
+
+  std::string_view Name() const {
+    const auto& n = nodes[index];
+    return {names + n.nameOffset, n.nameSize};
+  }
+
+  bool IsLeaf() const {
+    return nodes[index].childCount == PACKED_LEAF;
+  }
+
+  bool IsNull() const {
+    return nodes[index].childCount == PACKED_NULL;
+  }
+
+  std::size_t ChildCount() const {
+    return IsLeaf() || IsNull() ? 0 : nodes[index].childCount;
+  }
+
+  TNodeView Child(std::size_t i) const {
+    if (i >= ChildCount()) {
+      throw std::runtime_error("Can't access child: index out of range");
+    }
+    return {nodes, names, nodeCount, static_cast<std::uint32_t>(nodes[index].firstChild + i)};
+  }
+};
+
+// Maps a file written by TreeToBinary into memory. Nothing is deserialized:
+// the views returned by Root() point straight into the mapping, so the tree
+// must outlive them. The nodes are checked once, so that views never read
+// outside the file and children always come after their parent (a corrupted
+// file can't make a walk go in circles).
+struct TMappedTree {
+  explicit TMappedTree(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Can't open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(TPackedHeader))) {
+      ::close(fd);
+      throw std::runtime_error("Not a tree file: " + path);
+    }
+    size = st.st_size;
+    data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Can't mmap " + path);
+    }
+    std::memcpy(&header, data, sizeof(header));
+    const std::size_t expected = sizeof(TPackedHeader)
+        + std::size_t{header.nodeCount} * sizeof(TPackedNode) + header.namesSize;
+    if (header.magic != TREE_MAGIC || header.version != TREE_FORMAT_VERSION
+        || header.nodeCount == 0 || size != expected) {
+      ::munmap(data, size);
+      throw std::runtime_error("Bad tree file header: " + path);
+    }
+    if (!NodesValid()) {
+      ::munmap(data, size);
+      throw std::runtime_error("Corrupted tree file: " + path);
+    }
+  }
+
+  TMappedTree(const TMappedTree&) = delete;
+  TMappedTree& operator=(const TMappedTree&) = delete;
+
+  ~TMappedTree() {
+    ::munmap(data, size);
+  }
+
+  TNodeView Root() const {
+    auto bytes = static_cast<const char*>(data);
+    auto nodes = reinterpret_cast<const TPackedNode*>(bytes + sizeof(TPackedHeader));
+    auto names = reinterpret_cast<const char*>(nodes + header.nodeCount);
+    return {nodes, names, header.nodeCount, 0};
+  }
+
+  std::size_t NodeCount() const {
+    return header.nodeCount;
+  }
+
+private:
+  bool NodesValid() const {
+    const auto nodes = Root().nodes;
+    for (std::uint32_t i = 0; i < header.nodeCount; i++) {
+      const auto& n = nodes[i];
+      if (std::uint64_t{n.nameOffset} + n.nameSize > header.namesSize) {
+        return false;
+      }
+      if (n.childCount != PACKED_LEAF && n.childCount != PACKED_NULL
+          && (n.firstChild <= i || std::uint64_t{n.firstChild} + n.childCount > header.nodeCount)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void* data;
+  std::size_t size;
+  TPackedHeader header;
+};
+
+// The same output as for the tree the file was written from
+inline void TreeToDot(std::ostream& os, TNodeView node) {
+  os << "strict digraph {\n";
+  TreeToDotHelper(os, node);
+  os << "}\n";
+}
+{{namespace_end}})";
+
+// The members of TTree for spans parsed inline, with --inline_rules
+const char* INLINED_SPANS_TEMPLATE = R"(std::vector<TInlinedSpan> inlined;  // in the order the spans were opened
+  std::uint32_t openSpan{NO_SPAN};
+
+  inline void BeginInlined(const char* nterm) {
+    auto index = static_cast<std::uint32_t>(inlined.size());
+    auto at = static_cast<std::uint32_t>(children.size());
+    inlined.push_back({nterm, at, at, openSpan});
+    openSpan = index;
+  }
+
+  inline void EndInlined() {
+    inlined[openSpan].end = static_cast<std::uint32_t>(children.size());
+    openSpan = inlined[openSpan].parent;
+  })";
+
+const char* EXPAND_INLINED_TEMPLATE = R"(inline std::vector<TPtr> ExpandSpan(TTree* t, std::vector<TPtr>& old,
+                                    const std::vector<std::vector<std::uint32_t>>& nested,
+                                    std::uint32_t span, std::size_t begin, std::size_t end) {
+  std::vector<TPtr> result;
+  const auto& spans = span == NO_SPAN ? nested.back() : nested[span];
+  std::size_t i = begin;
+  for (auto inner : spans) {
+    const auto& s = t->inlined[inner];
+    for (; i < s.begin; i++) {
+      result.push_back(std::move(old[i]));
+    }
+    auto wrapper = std::make_shared<TTree>();
+    wrapper->name = s.name;
+    for (auto& child : ExpandSpan(t, old, nested, inner, s.begin, s.end)) {
+      wrapper->AddChild(std::move(child));
+    }
+    result.push_back(std::move(wrapper));
+    i = s.end;
+  }
+  for (; i < end; i++) {
+    result.push_back(std::move(old[i]));
+  }
+  return result;
+}
+
+inline void ExpandNode(TTree* t) {
+  // nested[i] are the spans directly inside span i, the last one is for the node itself
+  std::vector<std::vector<std::uint32_t>> nested(t->inlined.size() + 1);
+  for (std::uint32_t i = 0; i < t->inlined.size(); i++) {
+    auto parent = t->inlined[i].parent;
+    nested[parent == NO_SPAN ? t->inlined.size() : parent].push_back(i);
+  }
+  std::vector<TPtr> old = std::move(t->children);
+  t->children.clear();
+  for (auto& child : ExpandSpan(t, old, nested, NO_SPAN, 0, old.size())) {
+    t->AddChild(std::move(child));
+  }
+  t->inlined.clear();
+}
+
+// Gives back the nodes of nonterminals that were parsed inline, so the tree
+// has the shape described by the grammar. Works in place; every node is
+// expanded on its own, so the order doesn't matter.
+inline void ExpandInlined(TNode* node) {
+  std::vector<TTree*> stack;
+  if (auto t = dynamic_cast<TTree*>(node); t != nullptr) {
+    stack.push_back(t);
+  }
+  while (!stack.empty()) {
+    auto t = stack.back();
+    stack.pop_back();
+    for (const auto& child : t->children) {
+      if (auto tree = dynamic_cast<TTree*>(child.get()); tree != nullptr) {
+        stack.push_back(tree);
+      }
+    }
+    if (!t->inlined.empty()) {
+      ExpandNode(t);
+    }
+  }
+})";
 
 const char* PARSER_TEMPLATE = R"(
 #pragma once
 
 #include <regex>
+#include <array>
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <charconv>
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
 #include "ast.hh"
+{{namespace_begin}}
 
+// No token can contain the whitespace the lexer skips, so every whitespace
+// character is a token boundary (see LexParallel)
+constexpr bool SPLITS_AT_WHITESPACE = {{splits_at_whitespace}};
 
-struct TLexer {
-public:
-  TLexer(std::shared_ptr<std::istream> input) : curTokenType{EToken::EPS}, is{input} {
-    buf.reserve(CAPACITY);
-    FillBuffer();
-    NextToken();
+// Value of a `%value TOKEN intern` token: equal names get equal ids
+struct TSymbol {
+  std::uint32_t id;
+
+  bool operator==(TSymbol other) const {
+    return id == other.id;
   }
 
-  void NextToken() {
-    if (curTokenType == EToken::MY_EOF) {
-      throw std::runtime_error("Attempt to call NextToken past the end");
-    }
+  bool operator!=(TSymbol other) const {
+    return id != other.id;
+  }
+};
+
+// Interned names of `%value ... intern` tokens. Ids are dense and never
+// reused. A lexer gets a table of its own unless it is given one, so the ids
+// of the inputs it parses are comparable; ParseBatch and ParseAll use one
+// table per batch. Only a concurrent table may be shared by several threads.
+struct TSymbolTable {
+  explicit TSymbolTable(bool concurrent = false)
+    : concurrent{concurrent} {}
+
+  std::uint32_t Intern(std::string_view name) {
     {
-      // consume all whitespace (our language is whitespace-insensetive)
-      auto [matched, s] = MatchPrefix(std::regex{"[ \t\n]*"});
-      if (matched) {
-        RemovePrefix(s.size());
+      auto lock = Lock<std::shared_lock<std::shared_mutex>>();
+      if (auto it = ids.find(name); it != ids.end()) {
+        return it->second;
       }
     }
-    if (buf.empty()) {
-      curToken.clear();
-      curTokenType = EToken::MY_EOF;
-      return;
-    }
-    std::pair<EToken, std::string> biggestMatch{EToken::EPS, ""};
-    for (const auto& [tokType, regex] : TOKEN_TO_REGEX) {
-      auto [matched, s] = MatchPrefix(regex);
-      if (matched && s.size() > biggestMatch.second.size()) {
-        biggestMatch = std::pair{tokType, s};
-      }
+    auto lock = Lock<std::unique_lock<std::shared_mutex>>();
+    if (auto it = ids.find(name); it != ids.end()) {
+      return it->second;
     }
+    const auto id = static_cast<std::uint32_t>(names.size());
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+    return id;
+  }
 
-    if (biggestMatch.first == EToken::EPS) {
-      curTokenType = EToken::MY_EOF;
-      curToken.clear();
-    } else {
-      curTokenType = biggestMatch.first;
-      curToken = biggestMatch.second;
-      RemovePrefix(curToken.size());
-    }
+  std::string_view Name(TSymbol symbol) const {
+    auto lock = Lock<std::shared_lock<std::shared_mutex>>();
+    return names.at(symbol.id);
   }
 
-  std::pair<EToken, std::string> Peek() {
-    return {curTokenType, curToken};
+  std::size_t Size() const {
+    auto lock = Lock<std::shared_lock<std::shared_mutex>>();
+    return names.size();
   }
 
-  void RemovePrefix(std::size_t n) {
-    // NOTE: it's important that std::move moves backward
-    std::move(buf.data() + n, buf.data() + buf.size(), buf.begin());
-    buf.resize(buf.size() - n);
-    FillBuffer();
+private:
+  template <class TLock>
+  TLock Lock() const {
+    return concurrent ? TLock{mutex} : TLock{};
   }
 
-  void FillBuffer() {
-    if (remains) {
-      const auto oldSize = buf.size();
-      buf.resize(CAPACITY);
-      is->read(buf.data() + oldSize, CAPACITY - oldSize);
-      const auto read = is->gcount();
-      buf.resize(oldSize + read);  // shrink
-      if (buf.size() < CAPACITY) {
-        remains = false;
-      }
+  const bool concurrent;
+  mutable std::shared_mutex mutex;
+  std::deque<std::string> names;  // a deque never moves them, ids point into it
+  std::unordered_map<std::string_view, std::uint32_t> ids;
+};
+
+// For TreeToDot and TreeToBinary: names the leaves of interned tokens after
+// their symbols
+inline TNodeNamer SymbolNames(std::shared_ptr<const TSymbolTable> symbols) {
+  return [symbols = std::move(symbols)](const TNode* node) -> std::string_view {
+    if (auto symbol = std::any_cast<TSymbol>(&node->value); symbol != nullptr && node->name.empty()) {
+      return symbols->Name(*symbol);
     }
+    return node->name;
+  };
+}
+
+// A token and, for tokens declared with %value, the value the lexer computed
+// from its text
+struct TToken {
+  EToken type;
+  std::string text;
+  std::any value;
+  std::size_t offset{0};  // of the first byte in the input, see Locate
+};
+
+template <class T>
+inline T FromChars(std::string_view text, const char* token) {
+  T value{};
+  const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (ec != std::errc{} || end != text.data() + text.size()) {
+    throw std::runtime_error(std::string{"Bad "} + token + " '" + std::string{text} + "'");
   }
+  return value;
+}
 
-  std::pair<bool, std::string> MatchPrefix(std::regex regex) {
-      std::cmatch m;
-      std::regex_search(buf.data(), buf.data() + buf.size(), m, regex);
-      if (m.empty() || m.prefix().str() != "") {
-        return {false, ""};
-      }
-      return {true, m[0].str()};
+// Runs the %value converter of the token, if it has one
+inline std::any TokenValue(EToken type, [[maybe_unused]] std::string_view text, [[maybe_unused]] TSymbolTable& symbols) {
+  switch (type) {
+    {{token_value_cases}}
+    default:
+      return {};
   }
+}
 
-private:
-  const std::vector<std::pair<EToken, std::regex>> TOKEN_TO_REGEX = {
-    // pairs of the form "{EToken::..., std::regex{...}}" joined by comma
-    {{token_to_regex}}
-  };
+// Literal tokens that another token matches too ("keywords") are not matched
+// on their own. The lexer looks up the text of the longest match in a perfect
+// hash of them instead.
+struct TKeyword {
+  std::string_view text;
+  EToken type;
+  std::uint16_t rank;  // it beats the tokens from TOKEN_TO_REGEX[rank] on
+};
 
-  bool remains{true};
-  std::string curToken;
-  EToken curTokenType;
-  std::shared_ptr<std::istream> is;
-  std::vector<char> buf;
-  static constexpr int CAPACITY = 32;
-  static constexpr int MAX_TOKEN_SIZE = 16;
+constexpr std::size_t KEYWORD_SLOTS = {{keyword_slots}};  // 0 without keywords
+constexpr std::array<TKeyword, KEYWORD_SLOTS> KEYWORDS{{
+  {{keywords}}
+}};
+
+// Same as KeywordHash in the generator
+constexpr std::size_t KeywordSlot(std::string_view text) {
+  std::uint32_t h = 2166136261u ^ {{keyword_seed}}u;
+  for (unsigned char c : text) {
+    h = (h ^ c) * 16777619u;
+  }
+  return (h ^ (h >> 15)) & (KEYWORD_SLOTS - 1);
+}
+
+// The keyword spelled `text`, if it beats TOKEN_TO_REGEX[index]
+inline std::optional<EToken> FindKeyword([[maybe_unused]] std::string_view text, [[maybe_unused]] std::size_t index) {
+  if constexpr (KEYWORD_SLOTS != 0) {
+    const auto& keyword = KEYWORDS[KeywordSlot(text)];
+    if (keyword.text == text && keyword.rank <= index) {
+      return keyword.type;
+    }
+  }
+  return std::nullopt;
+}
+
+// Tokens matched by one minimal DFA instead of their regexes (see
+// --dfa_lexer). Bytes are mapped to classes, and the transitions are stored as
+// a comb vector: the row of a state starts at DFA_BASE[state] and an entry
+// belongs to it only if DFA_CHECK says so. The start state is 0.
+constexpr bool DFA_LEXER = {{dfa_lexer}};
+using TDfaState = std::uint16_t;
+constexpr TDfaState DFA_DEAD = UINT16_MAX;
+constexpr std::uint8_t DFA_BYTE_CLASS[256] = {
+  {{dfa_byte_class}}
 };
+constexpr std::uint16_t DFA_BASE[] = {{{dfa_base}}};
+constexpr TDfaState DFA_NEXT[] = {{{dfa_next}}};
+constexpr TDfaState DFA_CHECK[] = {{{dfa_check}}};
+constexpr EToken DFA_ACCEPT[] = {{{dfa_accept}}};  // EPS if no token ends there
 
-struct TParser {
+constexpr TDfaState DfaNext(TDfaState state, char c) {
+  const std::size_t i = DFA_BASE[state] + DFA_BYTE_CLASS[static_cast<unsigned char>(c)];
+  return DFA_CHECK[i] == state ? DFA_NEXT[i] : DFA_DEAD;
+}
 
-  TParser(std::shared_ptr<TLexer> l, std::shared_ptr<IVisitor> v = GetVisitor()) : lexer{l}, visitor{v} {}
+// A character class as at most 4 byte ranges [lo, hi]. A token whose regex
+// is a `[...]+` class run has one, and is scanned by ScanClass instead of its
+// regex.
+struct TCharClass {
+  std::uint8_t count;
+  struct {
+    unsigned char lo;
+    unsigned char hi;
+  } ranges[4];
+};
 
-  // signature: TPtr Parse_<nterm name>(TNode* parent);
-  {{parsing_methods}}
+constexpr TCharClass WHITESPACE_CLASS{2, {{'\t', '\n'}, {' ', ' '}}};
 
-  TPtr Parse() {
-    return Parse_start(nullptr);
+inline bool InClass(const TCharClass& cls, char c) {
+  const auto u = static_cast<unsigned char>(c);
+  for (std::uint8_t i = 0; i < cls.count; i++) {
+    if (static_cast<unsigned char>(u - cls.ranges[i].lo) <= cls.ranges[i].hi - cls.ranges[i].lo) {
+      return true;
+    }
   }
+  return false;
+}
 
-private:
-  std::shared_ptr<TLexer> lexer;
-  std::shared_ptr<IVisitor> visitor;
-};
-)";
+inline const char* ScanClassScalar(const TCharClass& cls, const char* begin, const char* end) {
+  while (begin != end && InClass(cls, *begin)) {
+    ++begin;
+  }
+  return begin;
+}
 
-const char* PARSE_METHOD_TEMPLATE = R"(
-  TPtr Parse_{{nterm}}(TNode* par) {
-    auto r = std::make_shared<TTree>();
-    r->name = "{{nterm}}";
-    r->parent = par;
+#if defined(__x86_64__) || defined(__i386__)
+// A byte c is in [lo, hi] iff min(c - lo, hi - lo) == c - lo, unsigned
+__attribute__((target("sse2")))
+inline const char* ScanClassSse2(const TCharClass& cls, const char* begin, const char* end) {
+  __m128i lo[4];
+  __m128i span[4];
+  for (std::uint8_t i = 0; i < cls.count; i++) {
+    lo[i] = _mm_set1_epi8(static_cast<char>(cls.ranges[i].lo));
+    span[i] = _mm_set1_epi8(static_cast<char>(cls.ranges[i].hi - cls.ranges[i].lo));
+  }
+  for (; end - begin >= 16; begin += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    __m128i in = _mm_setzero_si128();
+    for (std::uint8_t i = 0; i < cls.count; i++) {
+      const __m128i shifted = _mm_sub_epi8(v, lo[i]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(shifted, span[i]), shifted));
+    }
+    const unsigned outside = ~static_cast<unsigned>(_mm_movemask_epi8(in)) & 0xFFFFu;
+    if (outside != 0) {
+      return begin + __builtin_ctz(outside);
+    }
+  }
+  return ScanClassScalar(cls, begin, end);
+}
 
-    auto [tokType, tok] = lexer->Peek();
-    switch (tokType) {
-      // inside case: if terminal -> AddChild and NextToken
-      //              else if translation symbol -> execute visitor->visit_{{ts_name}}
-      //              else if nterm -> AddChild(Parse_{{kid_nterm}}(r.get()))
-{{rule_cases}}
+__attribute__((target("avx2")))
+inline const char* ScanClassAvx2(const TCharClass& cls, const char* begin, const char* end) {
+  __m256i lo[4];
+  __m256i span[4];
+  for (std::uint8_t i = 0; i < cls.count; i++) {
+    lo[i] = _mm256_set1_epi8(static_cast<char>(cls.ranges[i].lo));
+    span[i] = _mm256_set1_epi8(static_cast<char>(cls.ranges[i].hi - cls.ranges[i].lo));
+  }
+  for (; end - begin >= 32; begin += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    __m256i in = _mm256_setzero_si256();
+    for (std::uint8_t i = 0; i < cls.count; i++) {
+      const __m256i shifted = _mm256_sub_epi8(v, lo[i]);
+      in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, span[i]), shifted));
+    }
+    const auto outside = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(in));
+    if (outside != 0) {
+      return begin + __builtin_ctz(outside);
     }
+  }
+  return ScanClassSse2(cls, begin, end);
+}
+#endif
 
-    return r;
+// The first byte of [begin, end) outside the class, or end. Picks the widest
+// kernel the CPU supports once per process.
+inline const char* ScanClass(const TCharClass& cls, const char* begin, const char* end) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2 ? ScanClassAvx2(cls, begin, end) : ScanClassSse2(cls, begin, end);
+#else
+  return ScanClassScalar(cls, begin, end);
+#endif
+}
+
+inline std::size_t CountByteScalar(const char* begin, const char* end, char c) {
+  return std::count(begin, end, c);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+inline std::size_t CountByteSse2(const char* begin, const char* end, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  std::size_t count = 0;
+  for (; end - begin >= 16; begin += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    count += __builtin_popcount(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle))));
   }
-)";
+  return count + CountByteScalar(begin, end, c);
+}
 
-const char* MAIN_TEMPLATE = R"(
-#include <fstream>
+__attribute__((target("avx2")))
+inline std::size_t CountByteAvx2(const char* begin, const char* end, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  std::size_t count = 0;
+  for (; end - begin >= 32; begin += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    count += __builtin_popcount(static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle))));
+  }
+  return count + CountByteSse2(begin, end, c);
+}
+#endif
 
-#include "parser.hh"
-#include "ast.hh"
+// The number of c in [begin, end)
+inline std::size_t CountByte(const char* begin, const char* end, char c) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2 ? CountByteAvx2(begin, end, c) : CountByteSse2(begin, end, c);
+#else
+  return CountByteScalar(begin, end, c);
+#endif
+}
 
-struct TVisitor : IVisitor {
-  // TODO: write the implementation of visit methods if there are any (they are
-  // all abstract
-  using T = int;
+// 1-based, the column counts bytes
+struct TSourcePosition {
+  std::size_t line;
+  std::size_t column;
+};
 
-  T GetT(const TNode* n) {
-    try {
-      return std::any_cast<T>(n->value);
-    } catch (...) {
-      std::cerr << "Caught in TNode* with name " << n->name << std::endl;
-      throw;
+// Converts token offsets to positions for diagnostics, so that lexing doesn't
+// track lines at all. Text still in memory is only looked at once a position
+// is asked for; of the text a streaming lexer drops from its buffer, only the
+// number of lines and where the last one starts are kept.
+class TLineIndex {
+public:
+  // `text` is the input from offset `base` on, and nothing before base is
+  // missing from Drop. nullopt for an offset on a dropped line but the last.
+  std::optional<TSourcePosition> Locate(std::string_view text, std::size_t base, std::size_t offset) const {
+    if (offset < base) {
+      if (offset < lastStart) {
+        return std::nullopt;
+      }
+      return TSourcePosition{newlines + 1, offset - lastStart + 1};
     }
+    const auto before = text.substr(0, offset - base);
+    const auto newline = before.rfind('\n');
+    const std::size_t lineStart = newline != std::string_view::npos ? base + newline + 1 : lastStart;
+    const auto lines = CountByte(before.data(), before.data() + before.size(), '\n');
+    return TSourcePosition{newlines + lines + 1, offset - lineStart + 1};
   }
 
-  T GetT(const std::shared_ptr<TNode>& n) {
-    return GetT(n.get());
+  // `text` is the input from offset `base` on, up to where the previous Drop
+  // began
+  void Drop(std::string_view text, std::size_t base) {
+    newlines += CountByte(text.data(), text.data() + text.size(), '\n');
+    if (const auto newline = text.rfind('\n'); newline != std::string_view::npos) {
+      lastStart = base + newline + 1;
+    }
   }
 
-  bool IsEps(const TNode* n) {
-    auto t = dynamic_cast<const TTree*>(n);
-    if (t == nullptr) {
-      return false;
-    }
-    return t->children.empty();
+  void Clear() {
+    newlines = 0;
+    lastStart = 0;
   }
 
-  {{visit_overrides}}
+private:
+  std::size_t newlines = 0;  // in dropped text
+  std::size_t lastStart = 0;  // of the last line that starts in dropped text
 };
 
-std::shared_ptr<IVisitor> GetVisitor() {
-  // TODO: tweak this function to your liking
-  return std::make_shared<TVisitor>();
+// The message followed by the line and column of the token, or by its byte
+// offset if the position is unknown
+inline std::string WithPosition(std::string message, std::size_t offset, std::optional<TSourcePosition> position) {
+  if (position) {
+    return message + " (line " + std::to_string(position->line) + ", column " + std::to_string(position->column) + ')';
+  }
+  return message + " (byte " + std::to_string(offset) + ')';
 }
 
-int main(int argc, char** argv) {
-  std::shared_ptr<std::istream> source;
-  if (argc == 1) {
-    // read from stdin
-    source = std::shared_ptr<std::istream>(&std::cin, [](auto) {});
-    // custom noop deleter for std::cin
-  } else {
-    assert(argc == 2);
-    source = std::make_shared<std::ifstream>(std::string{argv[1]});
-  }
-  auto lexer = std::make_shared<TLexer>(source);
-  auto parser = std::make_shared<TParser>(lexer);
+// No rule of the parse method `where` starts with the token
+inline std::string UnexpectedMessage(const TToken& token, std::string_view where) {
+  return "Unexpected " + (token.type == EToken::MY_EOF ? std::string{"end of input"} : token.text) + " at " + std::string{where};
+}
+
+inline std::string MissingMessage(std::string_view expected, const TToken& token) {
+  return "Expected " + std::string{expected} + " but got " + (token.type == EToken::MY_EOF ? std::string{"end of input"} : "'" + token.text + "'");
+}
+
+// Input is UTF-8 and the token DFA matches code points (see --utf8). The
+// lexer rejects malformed input as it reads it.
+constexpr bool UTF8_INPUT = {{utf8}};
+
+constexpr TCharClass ASCII_CLASS{1, {{0, 0x7F}}};
+
+// The end of the well-formed UTF-8 sequence at begin (Table 3-7 of the
+// Unicode Standard), or begin if there is none before end
+inline const char* Utf8Sequence(const char* begin, const char* end) {
+  const auto lead = static_cast<unsigned char>(*begin);
+  std::ptrdiff_t length = 3;
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  if (lead < 0x80) {
+    return begin + 1;
+  } else if (lead >= 0xC2 && lead <= 0xDF) {
+    length = 2;
+  } else if (lead == 0xE0) {
+    lo = 0xA0;  // overlong
+  } else if (lead == 0xED) {
+    hi = 0x9F;  // surrogates
+  } else if (lead >= 0xE1 && lead <= 0xEF) {
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    length = 4;
+    lo = lead == 0xF0 ? 0x90 : 0x80;  // overlong
+    hi = lead == 0xF4 ? 0x8F : 0xBF;  // past U+10FFFF
+  } else {
+    return begin;
+  }
+  if (end - begin < length) {
+    return begin;
+  }
+  const auto second = static_cast<unsigned char>(begin[1]);
+  if (second < lo || second > hi) {
+    return begin;
+  }
+  for (std::ptrdiff_t i = 2; i < length; i++) {
+    if ((static_cast<unsigned char>(begin[i]) & 0xC0) != 0x80) {
+      return begin;
+    }
+  }
+  return begin + length;
+}
+
+// The first byte of [begin, end) that doesn't start well-formed UTF-8, or
+// end. ASCII runs are skipped a vector at a time.
+inline const char* ScanUtf8(const char* begin, const char* end) {
+  while ((begin = ScanClass(ASCII_CLASS, begin, end)) != end) {
+    const char* next = Utf8Sequence(begin, end);
+    if (next == begin) {
+      return begin;
+    }
+    begin = next;
+  }
+  return end;
+}
+
+// A lexer or parser must only be used by one thread at a time, but any number
+// of them can run in parallel: the compiled token tables are immutable and
+// shared. Visitors are not synchronized, give every thread its own.
+struct TLexer {
+public:
+  TLexer(std::shared_ptr<std::istream> input, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>())
+    : symbols{std::move(symbols)} {
+    buf.reserve(CAPACITY);
+    Reset(std::move(input));
+  }
+
+  // Push mode: the input is handed over by Feed and Finish, and tokens are
+  // only lexed by Poll, once the input so far decides them. The buffer grows
+  // with what is fed instead of taking CAPACITY up front.
+  explicit TLexer(std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>())
+    : symbols{std::move(symbols)} {}
+
+  void Feed(std::string_view chunk) {
+    Compact();
+    buf.insert(buf.end(), chunk.begin(), chunk.end());
+    if constexpr (UTF8_INPUT) {
+      ValidateUtf8();
+    }
+  }
+
+  // The end of the input
+  void Finish() {
+    remains = false;
+    if constexpr (UTF8_INPUT) {
+      ValidateUtf8();
+    }
+  }
+
+  // Lexes the token after the one Consume was last called for (the first
+  // one at the start) into Peek, unless the input still has to go on for
+  // that: then it's false until more is fed or Finish is called.
+  bool Poll() {
+    if (polled) {
+      return true;
+    }
+    const char* begin = buf.data() + pos;
+    pos += ScanClass(WHITESPACE_CLASS, begin, buf.data() + buf.size()) - begin;
+    if (remains && (pos == buf.size() || !Decided())) {
+      return false;
+    }
+    NextToken();
+    polled = true;
+    return true;
+  }
+
+  void Consume() {
+    polled = false;
+  }
+
+  // Starts over on a new input, keeping the buffer
+  void Reset(std::shared_ptr<std::istream> input) {
+    is = std::move(input);
+    buf.clear();
+    pos = 0;
+    validated = 0;
+    offset = 0;
+    lines.Clear();
+    remains = true;
+    cur = TToken{EToken::EPS, "", {}};
+    FillBuffer();
+    NextToken();
+  }
+
+  void NextToken() {
+    if (cur.type == EToken::MY_EOF) {
+      throw std::runtime_error("Attempt to call NextToken past the end");
+    }
+    cur.value.reset();
+    // consume all whitespace (our language is whitespace-insensetive), the
+    // run may go on past the buffer
+    for (bool more = true; more;) {
+      const char* begin = buf.data() + pos;
+      const char* end = buf.data() + buf.size();
+      const char* stop = ScanClass(WHITESPACE_CLASS, begin, end);
+      more = stop == end && remains && is != nullptr;
+      RemovePrefix(stop - begin);
+    }
+    cur.offset = offset + pos;
+    if (pos == buf.size()) {
+      cur.text.clear();
+      cur.type = EToken::MY_EOF;
+      return;
+    }
+    // A token longer than CAPACITY / 2 can run past the end of the buffer:
+    // then the buffer grows and the token is matched again rather than cut
+    std::pair<EToken, std::string> biggestMatch{EToken::EPS, ""};
+    for (bool cut = true; cut; ) {
+      std::size_t index = 0;
+      if constexpr (DFA_LEXER) {
+        biggestMatch = MatchDfa(&cut);
+      } else {
+        biggestMatch = {EToken::EPS, ""};
+        for (std::size_t i = 0; i < TOKEN_TO_REGEX.size(); i++) {
+          auto [matched, s] = !TOKEN_LITERALS[i].empty() ? MatchLiteral(TOKEN_LITERALS[i])
+            : TOKEN_CLASSES[i].count != 0 ? MatchClass(TOKEN_CLASSES[i])
+            : MatchPrefix(TOKEN_TO_REGEX[i].second);
+          if (matched && s.size() > biggestMatch.second.size()) {
+            biggestMatch = std::pair{TOKEN_TO_REGEX[i].first, s};
+            index = i;
+          }
+        }
+        cut = pos + biggestMatch.second.size() == buf.size();
+      }
+      cut = cut && remains && is != nullptr;
+      if (cut) {
+        FillBuffer(2 * (buf.size() - pos));
+      } else if constexpr (!DFA_LEXER) {
+        if (auto keyword = FindKeyword(biggestMatch.second, index); keyword) {
+          biggestMatch.first = *keyword;
+        }
+      }
+    }
+
+    if (biggestMatch.first == EToken::EPS) {
+      cur.type = EToken::MY_EOF;
+      cur.text.clear();
+    } else {
+      cur.type = biggestMatch.first;
+      cur.text = biggestMatch.second;
+      cur.value = TokenValue(cur.type, cur.text, *symbols);
+      RemovePrefix(cur.text.size());
+    }
+  }
+
+  const TToken& Peek() const {
+    return cur;
+  }
+
+  // After MY_EOF: false if the lexer stopped at something that is not a token
+  bool ReachedEnd() const {
+    return pos == buf.size() && !remains;
+  }
+
+  // Where the lexer interns tokens, see TSymbolTable
+  const std::shared_ptr<TSymbolTable>& Symbols() const {
+    return symbols;
+  }
+
+  // Of any token this lexer returned since the last Reset
+  std::optional<TSourcePosition> Locate(std::size_t at) const {
+    return lines.Locate({buf.data(), buf.size()}, offset, at);
+  }
+
+  // Tokens are matched against the unread part of the buffer, so it is
+  // refilled once less than CAPACITY / 2 bytes are left, so tokens up to
+  // that long never have to grow it (see NextToken).
+  void RemovePrefix(std::size_t n) {
+    pos += n;
+    if (buf.size() - pos < CAPACITY / 2) {
+      FillBuffer();
+    }
+  }
+
+  // Drops the part of the buffer that is already read
+  void Compact() {
+    lines.Drop({buf.data(), pos}, offset);
+    buf.erase(buf.begin(), buf.begin() + pos);
+    validated -= pos;
+    offset += pos;
+    pos = 0;
+  }
+
+  // Reads until the buffer holds `capacity` bytes or the input ends
+  void FillBuffer(std::size_t capacity = CAPACITY) {
+    if (remains && is != nullptr) {
+      Compact();
+      const auto oldSize = buf.size();
+      buf.resize(capacity);
+      is->read(buf.data() + oldSize, capacity - oldSize);
+      const auto read = is->gcount();
+      buf.resize(oldSize + read);  // shrink
+      if (buf.size() < capacity) {
+        remains = false;
+      }
+      if constexpr (UTF8_INPUT) {
+        ValidateUtf8();
+      }
+    }
+  }
+
+  // A sequence cut by the end of the buffer is checked again once the rest of
+  // it is read
+  void ValidateUtf8() {
+    const char* end = buf.data() + buf.size();
+    const char* stop = ScanUtf8(buf.data() + validated, end);
+    validated = stop - buf.data();
+    if (stop != end && (!remains || end - stop >= 4)) {
+      throw std::runtime_error("Invalid UTF-8 at byte " + std::to_string(offset + validated));
+    }
+  }
+
+  // Whether more input can't change the token at pos. The DFA knows exactly.
+  // The other matchers know once whitespace follows, if no token can contain
+  // any (SPLITS_AT_WHITESPACE), and otherwise get the CAPACITY / 2 bytes a
+  // streaming lexer has. The walk goes on where the last Poll for the same
+  // token left it, so feeding a long token in small chunks stays linear.
+  bool Decided() {
+    if (walkStart != offset + pos) {
+      walkStart = offset + pos;
+      walked = 0;
+      walkState = 0;
+    }
+    if constexpr (DFA_LEXER) {
+      for (; pos + walked < buf.size(); walked++) {
+        const auto next = DfaNext(walkState, buf[pos + walked]);
+        if (next == DFA_DEAD) {
+          return true;
+        }
+        walkState = next;
+      }
+      return false;
+    }
+    if constexpr (SPLITS_AT_WHITESPACE) {
+      for (; pos + walked < buf.size(); walked++) {
+        if (InClass(WHITESPACE_CLASS, buf[pos + walked])) {
+          return true;
+        }
+      }
+    }
+    return buf.size() - pos >= CAPACITY / 2;
+  }
+
+  std::pair<bool, std::string> MatchPrefix(const std::regex& regex) {
+      const char* begin = buf.data() + pos;
+      const char* end = buf.data() + buf.size();
+      std::cmatch m;
+      if (!std::regex_search(begin, end, m, regex, std::regex_constants::match_continuous)) {
+        return {false, ""};
+      }
+      return {true, m[0].str()};
+  }
+
+  // The longest token at the start of the unread input, ties go to the token
+  // declared first. Unlike std::regex, `|` doesn't prefer its left side.
+  // *cut tells whether the DFA was still alive at the end of the buffer.
+  std::pair<EToken, std::string> MatchDfa(bool* cut = nullptr) const {
+    const char* begin = buf.data() + pos;
+    const char* end = buf.data() + buf.size();
+    EToken type = EToken::EPS;
+    const char* last = begin;
+    TDfaState state = 0;
+    for (const char* p = begin; p != end;) {
+      state = DfaNext(state, *p++);
+      if (state == DFA_DEAD) {
+        break;
+      }
+      if (DFA_ACCEPT[state] != EToken::EPS) {
+        type = DFA_ACCEPT[state];
+        last = p;
+      }
+    }
+    if (cut != nullptr) {
+      *cut = state != DFA_DEAD;
+    }
+    return {type, std::string{begin, last}};
+  }
+
+  std::pair<bool, std::string> MatchLiteral(std::string_view literal) {
+    if (std::string_view{buf.data() + pos, buf.size() - pos}.substr(0, literal.size()) != literal) {
+      return {false, ""};
+    }
+    return {true, std::string{literal}};
+  }
+
+  std::pair<bool, std::string> MatchClass(const TCharClass& cls) {
+    const char* begin = buf.data() + pos;
+    const char* stop = ScanClass(cls, begin, buf.data() + buf.size());
+    return {stop != begin, std::string{begin, stop}};
+  }
+
+private:
+  // Compiled once per process rather than once per lexer
+  static inline const std::vector<std::pair<EToken, std::regex>> TOKEN_TO_REGEX = {
+    // pairs of the form "{EToken::..., std::regex{...}}" joined by comma, in
+    // the order of precedence, without keywords
+    {{token_to_regex}}
+  };
+  // TOKEN_CLASSES[i] and TOKEN_LITERALS[i] are for TOKEN_TO_REGEX[i]: the
+  // class if it's a class run (count is 0 otherwise), the string if it only
+  // matches one
+  static inline const std::vector<TCharClass> TOKEN_CLASSES = {
+    {{token_classes}}
+  };
+  static inline const std::vector<std::string_view> TOKEN_LITERALS = {
+    {{token_literals}}
+  };
+
+  bool remains{true};
+  bool polled{false};  // push mode: Peek is lexed and not consumed yet
+  TToken cur{EToken::EPS, "", {}};
+  std::shared_ptr<TSymbolTable> symbols;
+  std::shared_ptr<std::istream> is;
+  std::vector<char> buf;
+  std::size_t pos{0};  // buf[pos, size) is unread
+  std::size_t validated{0};  // buf[0, validated) is well-formed UTF-8
+  std::size_t offset{0};  // of buf[0] in the input
+  TLineIndex lines;
+  // push mode: Decided has walked buf[pos, pos + walked) of the token at
+  // offset walkStart and got to walkState
+  std::size_t walkStart{0};
+  std::size_t walked{0};
+  TDfaState walkState{0};
+  static constexpr std::size_t CAPACITY = 1 << 16;
+};
+
+// Lock-free ring for exactly one producer and one consumer thread. Both sides
+// move whole batches to touch the shared indices as rarely as possible.
+template <class T, std::size_t N>
+struct TSpscRing {
+  static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+  // Producer side, returns how many items were moved into the ring
+  template <class TIt>
+  std::size_t Push(TIt first, TIt last) {
+    const auto t = tail.load(std::memory_order_relaxed);
+    const auto h = head.load(std::memory_order_acquire);
+    const auto n = std::min<std::size_t>(last - first, N - (t - h));
+    for (std::size_t i = 0; i < n; i++) {
+      slots[(t + i) & (N - 1)] = std::move(first[i]);
+    }
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer side, appends at most maxItems items to out and returns how many
+  std::size_t Pop(std::vector<T>& out, std::size_t maxItems) {
+    const auto h = head.load(std::memory_order_relaxed);
+    const auto t = tail.load(std::memory_order_acquire);
+    const auto n = std::min(t - h, maxItems);
+    for (std::size_t i = 0; i < n; i++) {
+      out.push_back(std::move(slots[(h + i) & (N - 1)]));
+    }
+    head.store(h + n, std::memory_order_release);
+    return n;
+  }
+
+  // Only when neither side is running
+  void Clear() {
+    head.store(0);
+    tail.store(0);
+  }
+
+private:
+  alignas(64) std::atomic<std::size_t> head{0};
+  alignas(64) std::atomic<std::size_t> tail{0};
+  std::vector<T> slots = std::vector<T>(N);
+};
+
+// Drop-in replacement for TLexer that runs a TLexer on its own thread, so
+// lexing overlaps with parsing. Pays off only on large inputs: starting the
+// thread costs more than lexing a short line.
+struct TPipelinedLexer {
+  // Only the lexer thread interns into symbols while it runs
+  explicit TPipelinedLexer(std::shared_ptr<std::istream> input, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>())
+    : symbols{std::move(symbols)} {
+    batch.reserve(BATCH);
+    Reset(std::move(input));
+  }
+
+  ~TPipelinedLexer() {
+    Stop();
+  }
+
+  TPipelinedLexer(const TPipelinedLexer&) = delete;
+  TPipelinedLexer& operator=(const TPipelinedLexer&) = delete;
+
+  void Reset(std::shared_ptr<std::istream> input) {
+    Stop();
+    lexer = nullptr;
+    ring.Clear();
+    error = nullptr;
+    stopping = false;
+    producer = std::thread{[this, input = std::move(input)] { Produce(input); }};
+    Refill();
+    CheckError();
+  }
+
+  void NextToken() {
+    if (batch[pos].type == EToken::MY_EOF) {
+      throw std::runtime_error("Attempt to call NextToken past the end");
+    }
+    if (++pos == batch.size()) {
+      Refill();
+    }
+    CheckError();
+  }
+
+  const TToken& Peek() const {
+    return batch[pos];
+  }
+
+  // Stops the lexer thread, call it only to report an error
+  std::optional<TSourcePosition> Locate(std::size_t at) {
+    Stop();
+    return lexer != nullptr ? lexer->Locate(at) : std::nullopt;
+  }
+
+private:
+  static constexpr std::size_t BATCH = 256;
+
+  void Refill() {
+    batch.clear();
+    pos = 0;
+    if (ring.Pop(batch, BATCH) == 0) {
+      std::unique_lock lock{mutex};
+      changed.wait(lock, [this] { return ring.Pop(batch, BATCH) != 0; });
+    }
+    Notify();  // there is room in the ring
+  }
+
+  // The lexer failed where TLexer would throw: when the consumer moves on to
+  // the token after the last one it lexed
+  void CheckError() {
+    if (batch[pos].type == EToken::MY_EOF && error) {
+      Stop();
+      std::rethrow_exception(error);
+    }
+  }
+
+  // Wakes the other side if it waits for the ring. Taking the mutex makes
+  // sure it either saw the change or is already waiting.
+  void Notify() {
+    { std::lock_guard lock{mutex}; }
+    changed.notify_one();
+  }
+
+  void Produce(std::shared_ptr<std::istream> input) {
+    std::vector<TToken> pending;
+    pending.reserve(BATCH);
+    try {
+      lexer = std::make_shared<TLexer>(input, symbols);  // read by Locate after Stop
+      for (bool done = false; !done;) {
+        pending.push_back(lexer->Peek());
+        done = pending.back().type == EToken::MY_EOF;
+        if (!done) {
+          lexer->NextToken();
+        }
+        if ((pending.size() == BATCH || done) && !Flush(pending)) {
+          return;
+        }
+      }
+    } catch (...) {
+      error = std::current_exception();  // published by the release in Push
+      pending.push_back(TToken{EToken::MY_EOF, "", {}});  // stands for the error
+      Flush(pending);
+    }
+  }
+
+  // False if the consumer went away before taking everything
+  bool Flush(std::vector<TToken>& pending) {
+    auto it = pending.begin();
+    auto push = [&] {
+      it += ring.Push(it, pending.end());
+      return it == pending.end() || stopping.load(std::memory_order_relaxed);
+    };
+    if (!push()) {
+      std::unique_lock lock{mutex};
+      changed.wait(lock, push);
+    }
+    Notify();
+    if (it != pending.end()) {
+      return false;
+    }
+    pending.clear();
+    return true;
+  }
+
+  void Stop() {
+    if (producer.joinable()) {
+      stopping = true;
+      Notify();
+      producer.join();
+    }
+  }
+
+  TSpscRing<TToken, 4096> ring;
+  std::vector<TToken> batch;
+  std::size_t pos{0};
+  std::exception_ptr error;
+  std::atomic<bool> stopping{false};
+  std::mutex mutex;  // only to wait for the ring
+  std::condition_variable changed;  // the ring or stopping
+  std::shared_ptr<TSymbolTable> symbols;
+  std::shared_ptr<TLexer> lexer;
+  std::thread producer;
+};
+
+// Serves tokens lexed in advance, e.g. by LexParallel, followed by MY_EOF.
+// Several lexers can share the tokens, each serving its own range of them.
+struct TTokenVectorLexer {
+  explicit TTokenVectorLexer(std::vector<TToken> tokens, std::string_view input = {})
+    : TTokenVectorLexer(std::make_shared<const std::vector<TToken>>(std::move(tokens)), input) {}
+
+  // Serves (*tokens)[begin, end) and then stays at (*tokens)[end], e.g. the
+  // separator after a %split item: a parse of the range sees the same last
+  // token as a parse of all of them. `input` is the text the tokens were
+  // lexed from, for Locate; it must outlive the lexer.
+  TTokenVectorLexer(std::shared_ptr<const std::vector<TToken>> tokens, std::size_t begin, std::size_t end, std::string_view input = {})
+    : tokens{std::move(tokens)}, pos{begin}, end{end}, input{input} {
+    if (end < this->tokens->size()) {
+      endToken = (*this->tokens)[end];
+    } else if (!this->tokens->empty()) {
+      endToken.offset = this->tokens->back().offset;
+    }
+  }
+
+  explicit TTokenVectorLexer(std::shared_ptr<const std::vector<TToken>> tokens, std::string_view input = {})
+    : TTokenVectorLexer(tokens, 0, tokens->size(), input) {}
+
+  void NextToken() {
+    if (AtEnd() || Peek().type == EToken::MY_EOF) {
+      throw std::runtime_error("Attempt to call NextToken past the end");
+    }
+    pos++;
+  }
+
+  const TToken& Peek() const {
+    return AtEnd() ? endToken : (*tokens)[pos];
+  }
+
+  // Whether all tokens of the range were consumed
+  bool AtEnd() const {
+    return pos >= end;
+  }
+
+  std::optional<TSourcePosition> Locate(std::size_t at) const {
+    if (input.empty()) {
+      return std::nullopt;
+    }
+    return TLineIndex{}.Locate(input, 0, at);
+  }
+
+private:
+  std::shared_ptr<const std::vector<TToken>> tokens;
+  std::size_t pos;
+  std::size_t end;
+  std::string_view input;
+  TToken endToken{EToken::MY_EOF, "", {}};  // where the range ends
+};
+
+// Read-only istream buffer over memory that is owned elsewhere
+struct TMemoryBuf : std::streambuf {
+  explicit TMemoryBuf(std::string_view data) {
+    char* begin = const_cast<char*>(data.data());
+    setg(begin, begin, begin + data.size());
+  }
+};
+
+// Runs body(state, i) for every i < count on `threads` threads (0 means one
+// per core), every thread with its own state from makeState(). Threads claim
+// indices in small chunks off a shared counter, so one slow item doesn't hold
+// up the rest.
+template <class TMakeState, class TBody>
+void ParallelFor(std::size_t count, unsigned threads, TMakeState&& makeState, TBody&& body) {
+  static constexpr std::size_t CHUNK = 16;
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min<std::size_t>(threads, (count + CHUNK - 1) / CHUNK);
+  std::atomic<std::size_t> next{0};
+  auto worker = [&]() {
+    auto state = makeState();
+    for (;;) {
+      const auto begin = next.fetch_add(CHUNK, std::memory_order_relaxed);
+      if (begin >= count) {
+        break;
+      }
+      for (auto i = begin; i < std::min(begin + CHUNK, count); i++) {
+        body(state, i);
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : pool) {
+    t.join();
+  }
+}
+
+inline void RunPure([[maybe_unused]] IVisitor& visitor, [[maybe_unused]] TLazyTree* node) {
+  switch (node->deferred) {
+    case EPureAction::NONE:
+      break;
+    {{run_pure_cases}}
+  }
+  node->deferred = EPureAction::NONE;
+}
+
+// Runs the %pure actions deferred by the parser, children before parents, on
+// `threads` threads (0 means one per core) with a visitor from makeVisitor
+// each. The tree is cut into subtrees small enough to give every thread
+// plenty of them; those run in parallel, then the nodes above them run in
+// order on the calling thread.
+inline void EvaluatePure(TNode* root, unsigned threads = 0, const std::function<std::shared_ptr<IVisitor>()>& makeVisitor = GetVisitor) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // post-order, so a subtree is a contiguous range ending with its root
+  std::vector<TLazyTree*> nodes;
+  std::vector<std::size_t> sizes;
+  {
+    std::vector<std::pair<TLazyTree*, std::size_t>> stack;  // node, next child
+    if (auto tree = dynamic_cast<TLazyTree*>(root)) {
+      stack.emplace_back(tree, 0);
+    }
+    std::vector<std::size_t> starts;
+    while (!stack.empty()) {
+      auto& [node, next] = stack.back();
+      if (next == 0) {
+        starts.push_back(nodes.size());
+      }
+      if (next < node->children.size()) {
+        auto child = dynamic_cast<TLazyTree*>(node->children[next++].get());
+        if (child != nullptr) {
+          stack.emplace_back(child, 0);
+        }
+        continue;
+      }
+      nodes.push_back(node);
+      sizes.push_back(nodes.size() - starts.back());
+      starts.pop_back();
+      stack.pop_back();
+    }
+  }
+
+  const std::size_t grain = std::max<std::size_t>(1, nodes.size() / (threads * 64));
+  std::vector<std::pair<std::size_t, std::size_t>> subtrees;  // [begin, end) of nodes
+  std::vector<std::size_t> above;
+  for (std::vector<std::size_t> todo{nodes.size()}; !nodes.empty() && !todo.empty();) {
+    const auto end = todo.back();  // one past the subtree root
+    todo.pop_back();
+    const auto begin = end - sizes[end - 1];
+    if (end - begin <= grain || threads == 1) {
+      subtrees.emplace_back(begin, end);
+      continue;
+    }
+    above.push_back(end - 1);
+    for (auto child = end - 1; child > begin; child -= sizes[child - 1]) {
+      todo.push_back(child);
+    }
+  }
+
+  ParallelFor(subtrees.size(), threads, makeVisitor, [&](const std::shared_ptr<IVisitor>& visitor, std::size_t i) {
+    for (auto j = subtrees[i].first; j < subtrees[i].second; j++) {
+      RunPure(*visitor, nodes[j]);
+    }
+  });
+  std::sort(above.begin(), above.end());
+  auto visitor = makeVisitor();
+  for (auto j : above) {
+    RunPure(*visitor, nodes[j]);
+  }
+}
+
+inline bool IsBatched([[maybe_unused]] EAction action) {
+  {{is_batched}}
+}
+
+inline void RunBatch([[maybe_unused]] IVisitor& visitor, EAction action, [[maybe_unused]] const std::vector<TTree*>& nodes) {
+  switch (action) {
+    {{run_batch_cases}}
+    default:
+      break;
+  }
+}
+
+// Runs the pending actions of %batch symbols left by a lazy parser, one
+// visit_<symbol>_batch call per symbol, before anything is demanded. They
+// depend on nothing, so nothing has to run before them. Only EActions::Lazy
+// leaves them pending, the other modes run each where the parser reaches it.
+// The batch is a vector of the nodes: what an action reads from its node is
+// up to the visitor, so gathering it into arrays is too.
+inline void RunBatches(IVisitor& visitor, TNode* root) {
+  std::unordered_map<EAction, std::vector<TTree*>> batches;
+  std::vector<TLazyTree*> stack;
+  if (auto tree = dynamic_cast<TLazyTree*>(root); tree != nullptr) {
+    stack.push_back(tree);
+  }
+  while (!stack.empty()) {
+    auto node = stack.back();
+    stack.pop_back();
+    auto& pending = node->pending;
+    pending.erase(
+        std::remove_if(pending.begin() + node->nextPending, pending.end(), [&](const TPendingAction& a) {
+          if (!IsBatched(a.action)) {
+            return false;
+          }
+          batches[a.action].push_back(node);
+          return true;
+        }),
+        pending.end());
+    for (const auto& child : node->children) {
+      if (auto tree = dynamic_cast<TLazyTree*>(child.get()); tree != nullptr) {
+        stack.push_back(tree);
+      }
+    }
+  }
+  for (const auto& [action, nodes] : batches) {
+    RunBatch(visitor, action, nodes);
+  }
+}
+
+// Lexes a large input on `threads` threads (0 means one per core) and
+// returns the same tokens as TLexer would, MY_EOF included. The input is cut
+// into chunks at whitespace, which can't be inside a token when
+// SPLITS_AT_WHITESPACE holds (otherwise this lexes on one thread), and chunks
+// smaller than minChunk bytes aren't worth a thread. All chunks intern into
+// symbols, which has to be concurrent.
+inline std::vector<TToken> LexParallel(std::string_view input, unsigned threads = 0, std::size_t minChunk = 1 << 20, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>(true)) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // A token with whitespace inside (a string literal, a comment) can start
+  // any distance before a cut, so a chunk can't tell whether it starts inside
+  // one without lexing everything before it. Speculating instead, i.e. lexing
+  // each chunk from every DFA state and stitching the runs, would multiply the
+  // work by the state count and has no counterpart for the std::regex lexer.
+  if (!SPLITS_AT_WHITESPACE) {
+    threads = 1;
+  }
+  const auto chunkSize = std::max(minChunk, input.size() / threads + 1);
+  std::vector<std::size_t> bounds{0};
+  while (bounds.back() < input.size()) {
+    auto next = std::min(bounds.back() + chunkSize, input.size());
+    next = std::min(input.find_first_of(" \t\n", next), input.size());
+    bounds.push_back(next);
+  }
+
+  struct TChunk {
+    std::vector<TToken> tokens;
+    bool complete{false};  // the lexer didn't stop at garbage
+    std::size_t end{0};  // where it stopped
+  };
+  std::vector<TChunk> chunks(bounds.size() - 1);
+  auto lexChunk = [&](std::size_t i) {
+    TMemoryBuf buf{input.substr(bounds[i], bounds[i + 1] - bounds[i])};
+    TLexer lexer{std::shared_ptr<std::istream>(std::make_shared<std::istream>(&buf)), symbols};
+    while (lexer.Peek().type != EToken::MY_EOF) {
+      chunks[i].tokens.push_back(lexer.Peek());
+      chunks[i].tokens.back().offset += bounds[i];
+      lexer.NextToken();
+    }
+    chunks[i].complete = lexer.ReachedEnd();
+    chunks[i].end = lexer.Peek().offset + bounds[i];
+  };
+  std::vector<std::thread> pool;
+  for (std::size_t i = 1; i < chunks.size(); i++) {
+    pool.emplace_back(lexChunk, i);
+  }
+  if (!chunks.empty()) {
+    lexChunk(0);
+  }
+  for (auto& t : pool) {
+    t.join();
+  }
+
+  // stitch, stopping where a sequential lexer would have stopped
+  std::vector<TToken> tokens;
+  std::size_t end = 0;
+  for (auto& chunk : chunks) {
+    std::move(chunk.tokens.begin(), chunk.tokens.end(), std::back_inserter(tokens));
+    end = chunk.end;
+    if (!chunk.complete) {
+      break;
+    }
+  }
+  tokens.push_back(TToken{EToken::MY_EOF, "", {}, end});
+  return tokens;
+}
+
+// The grammar has %depends, so EActions::Lazy is available
+constexpr bool HAS_DEPENDS = {{has_depends}};
+
+// Generated with --recover, so EOnError::Recover is available
+constexpr bool RECOVER = {{recover}};
+
+// When the parser runs the actions of translation symbols
+enum class EActions {
+  Eager,      // as soon as they are reached
+  DeferPure,  // the same, except for %pure ones: those are left to EvaluatePure
+  Lazy,       // never, they are left to Demand
+};
+
+// A node for a parser that runs actions as `actions` says
+inline std::shared_ptr<TTree> NewTree(EActions actions) {
+  if (actions == EActions::Eager) {
+    return std::make_shared<TTree>();
+  }
+  return std::make_shared<TLazyTree>();
+}
+
+// The parse methods as tables, for TPushParser and for EOnError::Recover in
+// TBasicParser. Expanding a nonterminal
+// replaces it on the stack by the items of the rule PUSH_TABLE picks for the
+// lookahead.
+enum class EPushItem : std::uint8_t {
+  Token,       // id is an EToken: matched and added as a leaf
+  Node,        // id is a nonterminal with a node of its own
+  Inline,      // the same, parsed right into the current node: groups, the
+               // tail of a flattened list
+  Inlined,     // the same, in an inlined span (see --inline_rules)
+  Action,      // id is an EAction
+  EndNode,
+  EndInlined,
+};
+
+struct TPushItem {
+  EPushItem kind;
+  std::uint16_t id;
+};
+
+// What a Node does with the rule, see --elide_eps and --collapse_chains
+enum class EPushRule : std::uint8_t {
+  Plain,
+  Elided,     // a nullptr child instead of the node
+  Collapsed,  // the items go right to the parent
+};
+
+struct TPushRule {
+  EPushRule kind;
+  std::uint16_t begin;  // in PUSH_ITEMS
+  std::uint16_t size;
+};
+
+constexpr const char* TOKEN_NAMES[] = {{{token_names}}};  // by EToken
+constexpr bool INTERNED_TOKENS[] = {{{interned_tokens}}};  // by EToken, their leaves only keep the TSymbol
+constexpr std::size_t PUSH_TOKENS = std::size(TOKEN_NAMES);
+constexpr const char* PUSH_NTERMS[] = {{{push_nterms}}};
+constexpr const char* PUSH_OWNERS[] = {{{push_owners}}};  // whose parse method reports errors
+constexpr std::uint16_t PUSH_START = {{push_start}};
+constexpr TPushRule PUSH_RULES[] = {
+  {{push_rules}}
+};
+constexpr TPushItem PUSH_ITEMS[] = {
+  {{push_items}}
+};
+constexpr std::int16_t PUSH_NO_RULE = -1;
+constexpr std::int16_t PUSH_TABLE[][PUSH_TOKENS] = {
+  {{push_table}}
+};
+// Tokens that may follow each nonterminal, where TBasicParser::Recover gives
+// up on its rule
+constexpr bool FOLLOW_TABLE[][PUSH_TOKENS] = {
+  {{follow_table}}
+};
+
+inline void RunAction([[maybe_unused]] IVisitor& visitor, [[maybe_unused]] EAction action, [[maybe_unused]] TTree* node) {
+  switch (action) {
+    {{run_action_cases}}
+  }
+}
+
+inline EPureAction PureAction([[maybe_unused]] EAction action) {
+  {{pure_action}}
+}
+
+constexpr std::uint32_t ALL_CHILDREN = UINT32_MAX;
+
+// Where an action finds a node it %depends on
+enum class EDependency : std::uint8_t {
+  Parent,  // the parent of its node, up to the node
+  Back,    // child #(position - offset) of its node, position as in TPendingAction
+  Front,   // child #offset of its node
+};
+
+struct TDependency {
+  EDependency kind;
+  std::uint32_t offset;
+};
+
+// The %depends of every action, resolved to children by the generator: those
+// of EAction a are DEPENDS[DEPENDS_BEGIN[a], DEPENDS_BEGIN[a + 1])
+constexpr std::array<TDependency, {{depends_size}}> DEPENDS{{{{depends}}}};
+constexpr std::uint16_t DEPENDS_BEGIN[] = {{{depends_begin}}};
+
+// The node a dependency of an action reached at `position` in node is
+// demanded from, and up to which child. nullptr if there is no such node:
+// node is the root, or the child is an elided EPS node.
+inline std::pair<TLazyTree*, std::uint32_t> Dependency(TLazyTree* node, std::uint32_t position, TDependency dependency) {
+  switch (dependency.kind) {
+    case EDependency::Parent:
+      return {static_cast<TLazyTree*>(node->parent), node->index};
+    case EDependency::Back:
+      return {static_cast<TLazyTree*>(node->children[position - dependency.offset].get()), ALL_CHILDREN};
+    case EDependency::Front:
+      return {static_cast<TLazyTree*>(node->children[dependency.offset].get()), ALL_CHILDREN};
+  }
+  return {nullptr, 0};
+}
+
+// Runs the actions a lazy parser left in node, up to the ones reached before
+// its child #upTo, each after the ones it %depends on. Actions that nothing
+// demands never run. Dependencies are followed with an explicit stack: down a
+// list parsed by a tail loop, they go as deep as the list is long.
+inline void Demand(IVisitor& visitor, TTree* node, std::uint32_t upTo = ALL_CHILDREN) {
+  struct TFrame {
+    TLazyTree* node;
+    std::uint32_t upTo;
+    bool running;  // action, after its dependencies from DEPENDS[dep] on
+    TPendingAction action;
+    std::size_t dep;
+  };
+  std::vector<TFrame> stack;
+  if (auto lazy = dynamic_cast<TLazyTree*>(node); lazy != nullptr) {
+    stack.push_back({lazy, upTo, false, {}, 0});
+  }
+  while (!stack.empty()) {
+    auto& frame = stack.back();
+    if (!frame.running) {
+      auto& pending = frame.node->pending;
+      if (frame.node->nextPending == pending.size() || pending[frame.node->nextPending].position > frame.upTo) {
+        stack.pop_back();
+        continue;
+      }
+      frame.action = pending[frame.node->nextPending++];
+      frame.dep = DEPENDS_BEGIN[static_cast<std::size_t>(frame.action.action)];
+      frame.running = true;
+    }
+    if (frame.dep == DEPENDS_BEGIN[static_cast<std::size_t>(frame.action.action) + 1]) {
+      RunAction(visitor, frame.action.action, frame.node);
+      frame.running = false;
+      continue;
+    }
+    const auto [target, targetUpTo] = Dependency(frame.node, frame.action.position, DEPENDS[frame.dep++]);
+    if (target != nullptr) {
+      stack.push_back({target, targetUpTo, false, {}, 0});  // frame is gone after this
+    }
+  }
+}
+
+// What TBasicParser::Parse does on a syntax error
+enum class EOnError {
+  Throw,    // a std::runtime_error
+  Recover,  // panic mode: records it and goes on, see Recover
+  Return,   // records it and returns nullptr: every parse method checks for
+            // that after each call, so nothing unwinds by exception
+};
+
+// A syntax error that Parse recorded instead of throwing
+struct TDiagnostic {
+  std::string message;  // with the position
+  std::size_t offset;   // of the token
+};
+
+// TLexerImpl is TLexer, TPipelinedLexer or TTokenVectorLexer
+template <class TLexerImpl>
+struct TBasicParser {
+
+  TBasicParser(std::shared_ptr<TLexerImpl> l, std::shared_ptr<IVisitor> v = GetVisitor(), EActions actions = EActions::Eager)
+    : lexer{l}, visitor{v}, actions{actions} {
+    if (actions == EActions::Lazy && !HAS_DEPENDS) {
+      throw std::runtime_error("Lazy actions need %depends in the grammar");
+    }
+  }
+
+  // signature: TPtr Parse_<nterm name>(TNode* parent);
+  {{parsing_methods}}
+
+  TPtr Parse() {
+    diagnostics.clear();
+    failed = false;
+    stopped = false;
+    auto result = Parse_start(nullptr);
+    if constexpr (std::is_same_v<TLexerImpl, TPipelinedLexer>) {
+      for (auto& diagnostic : diagnostics) {
+        diagnostic.message = WithPosition(std::move(diagnostic.message), diagnostic.offset, lexer->Locate(diagnostic.offset));
+      }
+    }
+    return stopped ? nullptr : result;
+  }
+
+  // Parses another input with the same lexer and visitor
+  TPtr Parse(std::shared_ptr<std::istream> input) {
+    lexer->Reset(std::move(input));
+    return Parse();
+  }
+
+  // With Recover, Parse records syntax errors in Diagnostics, skips tokens up
+  // to one that a rule being parsed expects or that may follow it, and
+  // returns a partial tree. Missing tokens are left out of it. Actions stop
+  // at the first error, lazy and deferred ones are no longer recorded either,
+  // since their values would be garbage. Needs a parser generated with
+  // --recover.
+  // With Return, Parse returns nullptr at the first error, which is in
+  // Diagnostics: a rejected input costs about as much as an accepted one.
+  void OnError(EOnError mode) {
+    if (mode == EOnError::Recover && !RECOVER) {
+      throw std::runtime_error("EOnError::Recover needs a parser generated with --recover");
+    }
+    onError = mode;
+  }
+
+  // The errors of the last Parse, in input order
+  const std::vector<TDiagnostic>& Diagnostics() const {
+    return diagnostics;
+  }
+
+  // Throws a parse error about the current token, at its position
+  [[noreturn]] void Fail(std::string message) {
+    const auto& token = lexer->Peek();
+    throw std::runtime_error(WithPosition(std::move(message), token.offset, lexer->Locate(token.offset)));
+  }
+
+  // The current token doesn't fit the rule `where` is parsing
+  [[noreturn]] void Unexpected(std::string_view where) {
+    Fail(UnexpectedMessage(lexer->Peek(), where));
+  }
+
+private:
+  // Fails, or records the error as OnError says. Positions are looked up
+  // after the parse: a pipelined lexer stops for that.
+  void Report(std::string message) {
+    if (onError == EOnError::Throw) {
+      Fail(std::move(message));
+    }
+    // Located right away: a TLexer forgets where the lines of the text it
+    // drops start. Locate stops a TPipelinedLexer, so its errors are located
+    // after the parse, and those on lines dropped by then get a byte offset.
+    const auto offset = lexer->Peek().offset;
+    if constexpr (!std::is_same_v<TLexerImpl, TPipelinedLexer>) {
+      message = WithPosition(std::move(message), offset, lexer->Locate(offset));
+    }
+    diagnostics.push_back({std::move(message), offset});
+    failed = true;
+    stopped = onError == EOnError::Return;
+  }
+
+  // No rule of `nterm` (a PUSH_NTERMS index) starts with the current token.
+  // Returns true to parse the rule again, at a token it expects, or false to
+  // leave it as it is, at a token that may follow it or at the end, or to
+  // stop.
+  bool Recover(std::string_view where, std::uint16_t nterm) {
+    Report(UnexpectedMessage(lexer->Peek(), where));
+    while (!stopped) {
+      const auto type = lexer->Peek().type;
+      if (PUSH_TABLE[nterm][static_cast<std::size_t>(type)] != PUSH_NO_RULE) {
+        return true;
+      }
+      if (FOLLOW_TABLE[nterm][static_cast<std::size_t>(type)] || type == EToken::MY_EOF) {
+        return false;
+      }
+      lexer->NextToken();
+    }
+    return false;
+  }
+
+  // The current token is not `expected`, which the rule goes on without
+  // unless this returns false to stop
+  bool Missing(std::string_view expected) {
+    Report(MissingMessage(expected, lexer->Peek()));
+    return !stopped;
+  }
+
+  std::shared_ptr<TLexerImpl> lexer;
+  std::shared_ptr<IVisitor> visitor;
+  EActions actions;
+  EOnError onError{EOnError::Throw};
+  bool failed{false};   // since the start of Parse
+  bool stopped{false};  // by an error, with EOnError::Return
+  std::vector<TDiagnostic> diagnostics;
+};
+
+using TParser = TBasicParser<TLexer>;
+using TPipelinedParser = TBasicParser<TPipelinedLexer>;
+using TTokenVectorParser = TBasicParser<TTokenVectorLexer>;
+
+enum class EPushStatus {
+  NeedInput,
+  Done,
+};
+
+// Parses input that arrives in chunks without blocking: Feed returns
+// NeedInput once it has parsed everything the input so far decides, and the
+// parser keeps its stack until the next chunk. The tree and the actions are
+// the same as TParser's.
+struct TPushParser {
+  explicit TPushParser(std::shared_ptr<IVisitor> v = GetVisitor(), EActions actions = EActions::Eager, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>())
+    : lexer{std::move(symbols)}, visitor{std::move(v)}, actions{actions} {
+    if (actions == EActions::Lazy && !HAS_DEPENDS) {
+      throw std::runtime_error("Lazy actions need %depends in the grammar");
+    }
+    stack.push_back({EPushItem::Node, PUSH_START});
+  }
+
+  // Done means the tree is complete, like Parse() the rest of the input is
+  // ignored then
+  EPushStatus Feed(std::string_view chunk) {
+    if (stack.empty()) {
+      return EPushStatus::Done;
+    }
+    lexer.Feed(chunk);
+    return Run();
+  }
+
+  // The end of the input
+  TPtr Finish() {
+    lexer.Finish();
+    Run();
+    return result;
+  }
+
+  // nullptr until Done
+  const TPtr& Result() const {
+    return result;
+  }
+
+private:
+  EPushStatus Run() {
+    while (!stack.empty()) {
+      const auto item = stack.back();
+      if (item.kind == EPushItem::EndNode) {
+        stack.pop_back();
+        auto node = std::move(nodes.back());
+        nodes.pop_back();
+        AddChild(std::move(node));
+        continue;
+      }
+      if (item.kind == EPushItem::EndInlined) {
+        stack.pop_back();
+        nodes.back()->EndInlined();
+        continue;
+      }
+      if (item.kind == EPushItem::Action) {
+        stack.pop_back();
+        Act(static_cast<EAction>(item.id), nodes.back().get());
+        continue;
+      }
+      if (!lexer.Poll()) {
+        return EPushStatus::NeedInput;
+      }
+      const auto& token = lexer.Peek();
+      stack.pop_back();
+      if (item.kind == EPushItem::Token) {
+        if (token.type != static_cast<EToken>(item.id)) {
+          Fail(MissingMessage(TOKEN_NAMES[item.id], token));
+        }
+        auto child = std::make_shared<TLeaf>();
+        if (!INTERNED_TOKENS[item.id]) {
+          child->name = token.text;
+        }
+        child->value = token.value;
+        nodes.back()->AddChild(child);
+        lexer.Consume();
+        continue;
+      }
+      const auto ruleIndex = PUSH_TABLE[item.id][static_cast<std::size_t>(token.type)];
+      if (ruleIndex == PUSH_NO_RULE) {
+        Fail(UnexpectedMessage(token, std::string{"Parse_"} + PUSH_OWNERS[item.id]));
+      }
+      const auto& rule = PUSH_RULES[ruleIndex];
+      if (item.kind == EPushItem::Node && rule.kind == EPushRule::Elided) {
+        AddChild(nullptr);
+        continue;
+      }
+      if (item.kind == EPushItem::Node && rule.kind == EPushRule::Plain) {
+        auto node = NewTree(actions);
+        node->name = PUSH_NTERMS[item.id];
+        node->parent = nodes.empty() ? nullptr : nodes.back().get();
+        nodes.push_back(std::move(node));
+        stack.push_back({EPushItem::EndNode, 0});
+      } else if (item.kind == EPushItem::Inlined) {
+        nodes.back()->BeginInlined(PUSH_NTERMS[item.id]);
+        stack.push_back({EPushItem::EndInlined, 0});
+      }
+      for (auto i = rule.begin + rule.size; i-- > rule.begin;) {
+        stack.push_back(PUSH_ITEMS[i]);
+      }
+    }
+    return EPushStatus::Done;
+  }
+
+  void AddChild(TPtr child) {
+    if (nodes.empty()) {
+      result = std::move(child);
+    } else {
+      nodes.back()->AddChild(std::move(child));
+    }
+  }
+
+  void Act(EAction action, TTree* node) {
+    if (actions == EActions::Lazy) {
+      static_cast<TLazyTree*>(node)->pending.push_back({static_cast<std::uint32_t>(node->children.size()), action});
+    } else if (auto pure = PureAction(action); actions == EActions::DeferPure && pure != EPureAction::NONE) {
+      static_cast<TLazyTree*>(node)->deferred = pure;
+    } else {
+      RunAction(*visitor, action, node);
+    }
+  }
+
+  [[noreturn]] void Fail(std::string message) {
+    const auto& token = lexer.Peek();
+    throw std::runtime_error(WithPosition(std::move(message), token.offset, lexer.Locate(token.offset)));
+  }
+
+  TLexer lexer;
+  std::shared_ptr<IVisitor> visitor;
+  EActions actions;
+  std::vector<TPushItem> stack;
+  std::vector<std::shared_ptr<TTree>> nodes;  // the open ones, innermost last
+  TPtr result;
+};
+
+#if defined(__cpp_impl_coroutine)
+// A CoParse_* call: starts when awaited, and resumes the awaiting one when
+// done, without growing the stack
+struct TParseTask {
+  struct promise_type {
+    TPtr value;
+    std::exception_ptr error;
+    std::coroutine_handle<> continuation;
+
+    TParseTask get_return_object() {
+      return TParseTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    auto final_suspend() noexcept {
+      struct TFinal {
+        bool await_ready() noexcept {
+          return false;
+        }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          auto continuation = h.promise().continuation;
+          return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      return TFinal{};
+    }
+
+    void return_value(TPtr result) {
+      value = std::move(result);
+    }
 
-  auto result = parser->Parse();
-  TreeToDot(std::cout, result.get());
+    void unhandled_exception() {
+      error = std::current_exception();
+    }
+  };
+
+  explicit TParseTask(std::coroutine_handle<promise_type> handle) : handle{handle} {}
+  TParseTask(TParseTask&& other) noexcept : handle{std::exchange(other.handle, {})} {}
+  TParseTask& operator=(TParseTask&&) = delete;
+
+  ~TParseTask() {
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+
+  TPtr await_resume() {
+    if (handle.promise().error) {
+      std::rethrow_exception(handle.promise().error);
+    }
+    return std::move(handle.promise().value);
+  }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+// The parse methods as coroutines over a push-mode TLexer: a CoParse_*
+// method co_awaits Peek(), which suspends the whole parse until Feed or
+// Finish brings the input that decides the token. Same trees and actions as
+// TParser, with the control flow of the parse methods instead of TPushParser's
+// tables.
+struct TCoParser {
+  explicit TCoParser(std::shared_ptr<IVisitor> v = GetVisitor(), EActions actions = EActions::Eager, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>())
+    : lexer{std::make_shared<TLexer>(std::move(symbols))}, visitor{std::move(v)}, actions{actions} {
+    if (actions == EActions::Lazy && !HAS_DEPENDS) {
+      throw std::runtime_error("Lazy actions need %depends in the grammar");
+    }
+  }
+
+  TCoParser(const TCoParser&) = delete;
+  TCoParser& operator=(const TCoParser&) = delete;
+
+  // Done means the tree is complete, like Parse() the rest of the input is
+  // ignored then
+  EPushStatus Feed(std::string_view chunk) {
+    if (root && root->handle.done()) {
+      return EPushStatus::Done;
+    }
+    lexer->Feed(chunk);
+    return Resume();
+  }
+
+  // The end of the input
+  TPtr Finish() {
+    lexer->Finish();
+    Resume();
+    return result;
+  }
+
+  // nullptr until Done
+  const TPtr& Result() const {
+    return result;
+  }
+
+  // signature: TParseTask CoParse_<nterm name>(TNode* parent);
+  {{coroutine_methods}}
+
+private:
+  struct TTokenAwaiter {
+    TCoParser* parser;
+
+    bool await_ready() {
+      return parser->lexer->Poll();
+    }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+      parser->waiting = awaiting;
+    }
+
+    const TToken& await_resume() {
+      return parser->lexer->Peek();
+    }
+  };
+
+  // The current token, once there is enough input to lex it
+  TTokenAwaiter Peek() {
+    return TTokenAwaiter{this};
+  }
+
+  EPushStatus Resume() {
+    if (!root) {
+      root.emplace(CoParse_start(nullptr));
+      waiting = root->handle;
+    }
+    if (waiting && lexer->Poll()) {
+      std::exchange(waiting, {}).resume();
+    }
+    if (!root->handle.done()) {
+      return EPushStatus::NeedInput;
+    }
+    if (!result) {
+      result = root->await_resume();
+    }
+    return EPushStatus::Done;
+  }
+
+  [[noreturn]] void Fail(std::string message) {
+    const auto& token = lexer->Peek();
+    throw std::runtime_error(WithPosition(std::move(message), token.offset, lexer->Locate(token.offset)));
+  }
+
+  [[noreturn]] void Unexpected(std::string_view where) {
+    Fail(UnexpectedMessage(lexer->Peek(), where));
+  }
+
+  // Always EOnError::Throw: recovering would have to await the skipped
+  // tokens too
+  static constexpr bool failed = false;
+  static constexpr bool stopped = false;
+
+  bool Recover(std::string_view where, std::uint16_t) {
+    Unexpected(where);
+  }
+
+  bool Missing(std::string_view expected) {
+    Fail(MissingMessage(expected, lexer->Peek()));
+  }
+
+  std::shared_ptr<TLexer> lexer;
+  std::shared_ptr<IVisitor> visitor;
+  EActions actions;
+  std::optional<TParseTask> root;
+  std::coroutine_handle<> waiting;  // suspended in Peek
+  TPtr result;
+};
+#endif
+
+struct TPipelineTimings {
+  double interleaved;  // seconds
+  double pipelined;
+};
+
+// Parses the same input with both lexers to see whether pipelining pays off
+inline TPipelineTimings BenchPipelined(const std::string& input, std::shared_ptr<IVisitor> v = GetVisitor()) {
+  auto time = [&](auto parse) {
+    const auto start = std::chrono::steady_clock::now();
+    parse(std::make_shared<std::istringstream>(input));
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+  return {
+    time([&](auto in) { return TParser{std::make_shared<TLexer>(in), v}.Parse(); }),
+    time([&](auto in) { return TPipelinedParser{std::make_shared<TPipelinedLexer>(in), v}.Parse(); }),
+  };
+}
+
+enum class EBatchFormat {
+  Lines,           // one input per line
+  LengthPrefixed,  // "<decimal byte count>\n<bytes>", inputs may contain newlines
+};
+
+// Exactly one of tree and error is set
+struct TBatchResult {
+  std::size_t index{0};
+  TPtr tree;
+  std::string error;
+};
+
+struct TBatchSummary {
+  std::size_t ok{0};
+  std::size_t failed{0};
+};
+
+// Reads the next input of a batch into `input`, returns false at the end
+inline bool ReadRecord(std::istream& in, EBatchFormat format, std::size_t index, std::string& input) {
+  if (format == EBatchFormat::Lines) {
+    return static_cast<bool>(std::getline(in, input));
+  }
+  std::size_t size;
+  if (!(in >> size)) {
+    if (in.eof()) {
+      return false;
+    }
+    throw std::runtime_error("Bad length prefix of input #" + std::to_string(index));
+  }
+  if (in.get() != '\n') {
+    throw std::runtime_error("Expected a newline after the length of input #" + std::to_string(index));
+  }
+  input.resize(size);
+  if (!in.read(input.data(), size)) {
+    throw std::runtime_error("Input #" + std::to_string(index) + " is truncated");
+  }
+  return true;
+}
+
+// `parser` returns on syntax errors (EOnError::Return), only lexer and action
+// errors are caught
+inline TBatchResult ParseRecord(TParser& parser, std::shared_ptr<std::istringstream> record, std::size_t index) {
+  TBatchResult result{index, nullptr, ""};
+  try {
+    auto tree = parser.Parse(std::move(record));
+    if (parser.Diagnostics().empty()) {
+      result.tree = std::move(tree);
+    } else {
+      result.error = parser.Diagnostics().front().message;
+    }
+  } catch (const std::exception& e) {
+    result.error = e.what();
+  }
+  return result;
+}
+
+// Parses every input of `in` with a single lexer and parser, calling
+// onResult(const TBatchResult&) after each of them. A parse error only fails
+// its own input; a malformed length prefix stops the batch with an exception.
+template <class TCallback>
+TBatchSummary ParseBatch(std::istream& in, EBatchFormat format, TCallback&& onResult, std::shared_ptr<IVisitor> v = GetVisitor(), std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>()) {
+  auto record = std::make_shared<std::istringstream>();
+  TParser parser{std::make_shared<TLexer>(record, std::move(symbols)), v};
+  parser.OnError(EOnError::Return);
+  TBatchSummary summary;
+  std::string input;
+  for (std::size_t index = 0; ReadRecord(in, format, index, input); index++) {
+    record->clear();
+    record->str(input);
+    auto result = ParseRecord(parser, record, index);
+    (result.tree != nullptr ? summary.ok : summary.failed)++;
+    onResult(result);
+  }
+  return summary;
+}
+
+// Parses the inputs on `threads` threads (0 means one per core) and returns
+// the results in the order of the inputs. Each thread gets its own lexer,
+// parser and visitor from makeVisitor; they all intern into symbols, which has
+// to be concurrent.
+inline std::vector<TBatchResult> ParseAll(
+    const std::vector<std::string>& inputs,
+    unsigned threads = 0,
+    const std::function<std::shared_ptr<IVisitor>()>& makeVisitor = GetVisitor,
+    std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>(true)) {
+  std::vector<TBatchResult> results(inputs.size());
+  ParallelFor(
+      inputs.size(),
+      threads,
+      [&] {
+        auto record = std::make_shared<std::istringstream>();
+        auto state = std::pair{record, TParser{std::make_shared<TLexer>(record, symbols), makeVisitor()}};
+        state.second.OnError(EOnError::Return);
+        return state;
+      },
+      [&](auto& state, std::size_t i) {
+        auto& [record, parser] = state;
+        record->clear();
+        record->str(inputs[i]);
+        results[i] = ParseRecord(parser, record, i);
+      });
+  return results;
+}
+{{parse_tokens}}
+struct TCacheStats {
+  std::size_t hits{0};
+  std::size_t diskHits{0};
+  std::size_t misses{0};
+};
+
+// Exactly one of tree and mapped is set. A tree found on disk has no values
+// but the one of its root.
+struct TCachedParse {
+  TPtr tree;
+  std::shared_ptr<TMappedTree> mapped;
+  std::any value;  // of the root
+};
+
+// Turns the value of a root into bytes and back, so that TParseCache can keep
+// it on disk. encode returns std::nullopt for a value it can't store.
+struct TValueCodec {
+  std::function<std::optional<std::string>(const std::any&)> encode;
+  std::function<std::any(std::string_view)> decode;
+};
+
+// Stores a T byte by byte
+template <class T>
+TValueCodec TrivialValueCodec() {
+  static_assert(std::is_trivially_copyable_v<T>, "T has to be trivially copyable");
+  return {
+    [](const std::any& value) -> std::optional<std::string> {
+      const T* p = std::any_cast<T>(&value);
+      if (p == nullptr) {
+        return std::nullopt;
+      }
+      return std::string{reinterpret_cast<const char*>(p), sizeof(T)};
+    },
+    [](std::string_view bytes) -> std::any {
+      if (bytes.size() != sizeof(T)) {
+        throw std::runtime_error("Bad size of a cached value");
+      }
+      T value;
+      std::memcpy(&value, bytes.data(), sizeof(T));
+      return value;
+    },
+  };
+}
+
+// Content-addressed cache of parse results. Entries are keyed by a hash of the
+// input seeded with GRAMMAR_FINGERPRINT, and the input itself is kept next to
+// the result, so a hash collision is a miss rather than a wrong tree.
+// Cached trees are shared between hits: don't modify them.
+struct TParseCache {
+  // dir: where to keep trees across runs ("" means memory only)
+  // maxEntries: memory limit, the oldest entries are dropped first (0 means no limit)
+  // codec: for the values of roots on disk. A tree whose root has a value the
+  // codec can't store (any value without a codec) stays in memory only.
+  explicit TParseCache(std::string dir = "", std::size_t maxEntries = 0, std::shared_ptr<IVisitor> v = GetVisitor(), TValueCodec codec = {})
+    : dir{std::move(dir)}, maxEntries{maxEntries}, visitor{v}, codec{std::move(codec)} {}
+
+  TCachedParse Parse(const std::string& input) {
+    const auto key = HashBytes(input, GRAMMAR_FINGERPRINT);
+    if (auto it = memory.find(key); it != memory.end() && it->second.first == input) {
+      stats.hits++;
+      return {it->second.second, nullptr, it->second.second->value};
+    }
+    if (!dir.empty()) {
+      if (auto cached = LoadFromDisk(key, input); cached.mapped != nullptr) {
+        stats.diskHits++;
+        return cached;
+      }
+    }
+    stats.misses++;
+    auto lexer = std::make_shared<TLexer>(std::make_shared<std::istringstream>(input), symbols);
+    auto tree = TParser{lexer, visitor}.Parse();
+    Remember(key, input, tree);
+    if (!dir.empty()) {
+      StoreToDisk(key, input, tree.get());
+    }
+    return {tree, nullptr, tree->value};
+  }
+
+  const TCacheStats& Stats() const {
+    return stats;
+  }
+
+  // Of the interned tokens in cached trees
+  const TSymbolTable& Symbols() const {
+    return *symbols;
+  }
+
+private:
+  std::string PathFor(std::uint64_t key, const char* ext) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.%s", static_cast<unsigned long long>(key), ext);
+    return dir + name;
+  }
+
+  // A key already in memory (another input with the same hash) is replaced
+  // in place, so nothing has to make room for it
+  void Remember(std::uint64_t key, const std::string& input, TPtr tree) {
+    if (auto it = memory.find(key); it != memory.end()) {
+      it->second = std::pair{input, tree};
+      return;
+    }
+    if (maxEntries != 0 && memory.size() >= maxEntries) {
+      memory.erase(order.front());
+      order.pop_front();
+    }
+    memory.emplace(key, std::pair{input, tree});
+    order.push_back(key);
+  }
+
+  static std::optional<std::string> ReadAll(const std::string& path) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in) {
+      return std::nullopt;
+    }
+    return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+  }
+
+  // mapped is nullptr on a miss. The input is written last, so when it
+  // matches, the rest of the entry is complete.
+  TCachedParse LoadFromDisk(std::uint64_t key, const std::string& input) const {
+    if (ReadAll(PathFor(key, "input")) != input) {
+      return {};
+    }
+    try {
+      TCachedParse result{nullptr, std::make_shared<TMappedTree>(PathFor(key, "tree")), {}};
+      if (auto value = ReadAll(PathFor(key, "value")); value) {
+        if (!codec.decode) {
+          return {};
+        }
+        result.value = codec.decode(*value);
+      }
+      return result;
+    } catch (const std::runtime_error&) {
+      return {};  // torn or stale entry, just parse again
+    }
+  }
+
+  void StoreToDisk(std::uint64_t key, const std::string& input, const TNode* tree) const {
+    std::optional<std::string> value;
+    if (tree->value.has_value() && (!codec.encode || !(value = codec.encode(tree->value)))) {
+      return;
+    }
+    {
+      std::ofstream out{PathFor(key, "tree"), std::ios::binary};
+      TreeToBinary(out, tree, SymbolNames(symbols));
+    }
+    if (value) {
+      std::ofstream out{PathFor(key, "value"), std::ios::binary};
+      out << *value;
+    } else {
+      std::remove(PathFor(key, "value").c_str());
+    }
+    std::ofstream out{PathFor(key, "input"), std::ios::binary};
+    out << input;
+  }
+
+  std::string dir;
+  std::size_t maxEntries;
+  std::shared_ptr<IVisitor> visitor;
+  TValueCodec codec;
+  std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>();
+  std::unordered_map<std::uint64_t, std::pair<std::string, TPtr>> memory;
+  std::deque<std::uint64_t> order;
+  TCacheStats stats;
+};
+
+// Prints the value of a root, e.g. with std::any_cast to the visitor's type
+using TValuePrinter = std::function<void(std::ostream&, const std::any&)>;
+
+// The command line parser: main() of a generated main.cc only calls this.
+// Without printValue, --batch prints "ok" for parsed inputs and a single
+// parse prints only the tree.
+inline int RunDriver(int argc, char** argv, const TValuePrinter& printValue = {}) {
+  // --batch: every line is a separate input
+  // --batch=length: inputs are length-prefixed, see EBatchFormat
+  // --threads=N: parse a batch, or lex (and with %split parse) a single
+  // input, on N threads (0 means one per core)
+  // --pipelined: lex on a separate thread (not in batch mode)
+  // --push=N: feed the input to TPushParser N bytes at a time
+  // --coroutine: with --push, feed TCoParser instead (needs C++20)
+  // --recover: report every syntax error and print the partial tree (not with
+  // --threads or --push, needs a parser generated with --recover)
+  // --bench: time the input with and without --pipelined
+  // --defer-pure: run %pure actions after the parse, on --threads threads
+  // --lazy: run %batch actions in batches, then only the actions the value of
+  // the root needs (see %depends)
+  std::optional<EBatchFormat> batch;
+  unsigned threads = 1;
+  bool pipelined = false;
+  std::size_t pushChunk = 0;
+  bool coroutine = false;
+  bool recover = false;
+  bool bench = false;
+  EActions actions = EActions::Eager;
+  int argi = 1;
+  for (; argi < argc && std::string_view{argv[argi]}.substr(0, 2) == "--"; argi++) {
+    const std::string_view arg{argv[argi]};
+    if (arg == "--batch") {
+      batch = EBatchFormat::Lines;
+    } else if (arg == "--batch=length") {
+      batch = EBatchFormat::LengthPrefixed;
+    } else if (arg.substr(0, 10) == "--threads=") {
+      threads = std::stoul(std::string{arg.substr(10)});
+    } else if (arg == "--pipelined") {
+      pipelined = true;
+    } else if (arg.substr(0, 7) == "--push=") {
+      pushChunk = std::max<std::size_t>(1, std::stoul(std::string{arg.substr(7)}));
+    } else if (arg == "--coroutine") {
+      coroutine = true;
+    } else if (arg == "--recover") {
+      recover = true;
+    } else if (arg == "--bench") {
+      bench = true;
+    } else if (arg == "--defer-pure") {
+      actions = EActions::DeferPure;
+    } else if (arg == "--lazy") {
+      actions = EActions::Lazy;
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 2;
+    }
+  }
+  if (recover && !RECOVER) {
+    std::cerr << "--recover needs a parser generated with --recover" << std::endl;
+    return 2;
+  }
+  if (recover && (threads != 1 || pushChunk != 0)) {
+    std::cerr << "--recover doesn't work with --threads or --push" << std::endl;
+    return 2;
+  }
+  std::shared_ptr<std::istream> source;
+  if (argi == argc) {
+    // read from stdin
+    source = std::shared_ptr<std::istream>(&std::cin, [](auto) {});
+    // custom noop deleter for std::cin
+  } else if (argi + 1 == argc) {
+    source = std::make_shared<std::ifstream>(std::string{argv[argi]});
+  } else {
+    std::cerr << "Expected at most one input file" << std::endl;
+    return 2;
+  }
+  if (batch) {
+    const auto start = std::chrono::steady_clock::now();
+    auto print = [&printValue](const TBatchResult& r) {
+      std::cout << r.index << '\t';
+      if (r.tree == nullptr) {
+        std::cout << "error\t" << r.error << '\n';
+      } else if (printValue) {
+        printValue(std::cout, r.tree->value);
+        std::cout << '\n';
+      } else {
+        std::cout << "ok" << '\n';
+      }
+    };
+    TBatchSummary summary;
+    if (threads == 1) {
+      summary = ParseBatch(*source, *batch, print);
+    } else {
+      std::vector<std::string> inputs;
+      for (std::string input; ReadRecord(*source, *batch, inputs.size(), input);) {
+        inputs.push_back(input);
+      }
+      for (const auto& r : ParseAll(inputs, threads)) {
+        (r.tree != nullptr ? summary.ok : summary.failed)++;
+        print(r);
+      }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << summary.ok << " parsed, " << summary.failed << " failed in " << elapsed.count() << "s" << std::endl;
+    return summary.failed == 0 ? 0 : 1;
+  }
+  if (bench) {
+    const std::string input{std::istreambuf_iterator<char>{*source}, std::istreambuf_iterator<char>{}};
+    const auto timings = BenchPipelined(input);
+    std::cerr << "interleaved: " << timings.interleaved << "s, pipelined: " << timings.pipelined << "s" << std::endl;
+    return 0;
+  }
+  TPtr result;
+  std::vector<TDiagnostic> diagnostics;
+  auto symbols = std::make_shared<TSymbolTable>(threads != 1);
+  if (threads != 1) {
+    const std::string input{std::istreambuf_iterator<char>{*source}, std::istreambuf_iterator<char>{}};
+    result = ParseTokens(LexParallel(input, threads, 1 << 20, symbols), threads, GetVisitor, actions, input);
+  } else if (pushChunk != 0) {
+    auto feed = [&](auto& parser) {
+      std::vector<char> chunk(pushChunk);
+      while (source->read(chunk.data(), chunk.size()) || source->gcount() > 0) {
+        parser.Feed({chunk.data(), static_cast<std::size_t>(source->gcount())});
+      }
+      return parser.Finish();
+    };
+    if (coroutine) {
+#if defined(__cpp_impl_coroutine)
+      TCoParser parser{GetVisitor(), actions, symbols};
+      result = feed(parser);
+#else
+      std::cerr << "--coroutine needs a C++20 compiler" << std::endl;
+      return 2;
+#endif
+    } else {
+      TPushParser parser{GetVisitor(), actions, symbols};
+      result = feed(parser);
+    }
+  } else if (pipelined) {
+    TPipelinedParser parser{std::make_shared<TPipelinedLexer>(source, symbols), GetVisitor(), actions};
+    parser.OnError(recover ? EOnError::Recover : EOnError::Throw);
+    result = parser.Parse();
+    diagnostics = parser.Diagnostics();
+  } else {
+    auto lexer = std::make_shared<TLexer>(source, symbols);
+    auto parser = std::make_shared<TParser>(lexer, GetVisitor(), actions);
+    parser->OnError(recover ? EOnError::Recover : EOnError::Throw);
+    result = parser->Parse();
+    diagnostics = parser->Diagnostics();
+  }
+  if (!diagnostics.empty()) {
+    for (const auto& diagnostic : diagnostics) {
+      std::cerr << diagnostic.message << std::endl;
+    }
+    TreeToDot(std::cout, result.get(), SymbolNames(symbols));  // actions stopped at the first error
+    return 1;
+  }
+  if (actions == EActions::DeferPure) {
+    EvaluatePure(result.get(), threads);
+  } else if (auto root = dynamic_cast<TTree*>(result.get()); actions == EActions::Lazy && root != nullptr) {
+    auto visitor = GetVisitor();
+    RunBatches(*visitor, root);
+    Demand(*visitor, root);
+  }
+  TreeToDot(std::cout, result.get(), SymbolNames(symbols));
+  if (printValue) {
+    std::cerr << "The answer is ";
+    printValue(std::cerr, result->value);
+    std::cerr << std::endl;
+  }
+  return 0;
+}
+{{namespace_end}})";
+
+const char* PARSE_METHOD_TEMPLATE = R"(
+  {{result}} {{prefix}}{{nterm}}(TNode* par) {
+    auto tokType = {{peek}}.type;
+{{early_returns}}
+    auto r = NewTree(actions);
+    r->name = "{{nterm}}";
+    r->parent = par;
+
+    switch (tokType) {
+      // inside case: if terminal -> AddChild and NextToken
+      //              else if translation symbol -> execute visitor->visit_{{ts_name}}
+      //              else if nterm -> AddChild(Parse_{{kid_nterm}}(r.get()))
+{{rule_cases}}
+    }
+
+    {{return}} r;
+  }
+)";
+
+const char* TAIL_LOOP_METHOD_TEMPLATE = R"(
+  {{result}} {{prefix}}{{nterm}}(TNode* par) {
+    // {{nterm}} is tail-recursive, so instead of recursing we go down in a loop
+    // and then link the nodes bottom-up, running the actions that follow the
+    // recursive call. The resulting tree is the same.
+    std::vector<std::pair<std::shared_ptr<TTree>, int>> frames;  // (node, index of the alternative)
+    TNode* parent = par;
+    TPtr last;
+    while (true) {
+      auto tokType = {{peek}}.type;
+{{early_exits}}
+      auto r = NewTree(actions);
+      r->name = "{{nterm}}";
+      r->parent = parent;
+
+      switch (tokType) {
+{{rule_cases}}
+      }
+      last = r;
+      break;
+    }
+    while (!frames.empty()) {
+      auto [r, alternative] = std::move(frames.back());
+      frames.pop_back();
+      r->AddChild(last);
+{{unwind_actions}}
+      last = r;
+    }
+    {{return}} last;
+  }
+)";
+
+const char* FLAT_LIST_METHOD_TEMPLATE = R"(
+  {{result}} {{prefix}}{{nterm}}(TNode* par) {
+    auto tokType = {{peek}}.type;
+{{early_returns}}
+    auto r = NewTree(actions);
+    r->name = "{{nterm}}";
+    r->parent = par;
+
+    // {{nterm}} is tail-recursive and has no actions: every iteration adds its
+    // children to this node
+    for (bool more = true; more; tokType = {{peek}}.type) {
+      switch (tokType) {
+{{rule_cases}}
+      }
+    }
+
+    {{return}} r;
+  }
+)";
+
+const char* PARSE_TOKENS_TEMPLATE = R"(
+// Parses tokens from LexParallel. The grammar has no %split, so this runs on
+// one thread. `input` is the text of the tokens, for error positions.
+inline TPtr ParseTokens(std::vector<TToken> tokens, [[maybe_unused]] unsigned threads = 0, const std::function<std::shared_ptr<IVisitor>()>& makeVisitor = GetVisitor, EActions actions = EActions::Eager, std::string_view input = {}) {
+  return TTokenVectorParser{std::make_shared<TTokenVectorLexer>(std::move(tokens), input), makeVisitor(), actions}.Parse();
+}
+)";
+
+const char* SPLIT_PARSE_TOKENS_TEMPLATE = R"(
+// Parses tokens from LexParallel on `threads` threads (0 means one per core).
+// The grammar has `%split {{separator}}`, so the tokens are cut at every
+// {{separator}}, the pieces are parsed as {{item}} independently, and the
+// results are put under one start node in order: the same tree as Parse().
+// The items only join start at the end, which is why their actions need
+// %depends. All threads allocate nodes from the one heap: there are no
+// per-thread arenas, since the nodes are shared_ptrs that outlive the parse.
+// `input` is the text of the tokens, for error positions.
+inline TPtr ParseTokens(std::vector<TToken> tokens, unsigned threads = 0, const std::function<std::shared_ptr<IVisitor>()>& makeVisitor = GetVisitor, EActions actions = EActions::Eager, std::string_view input = {}) {
+  auto shared = std::make_shared<const std::vector<TToken>>(std::move(tokens));
+  std::vector<std::pair<std::size_t, std::size_t>> pieces;  // [begin, end) of each item
+  std::size_t begin = 0;
+  for (std::size_t i = 0; i < shared->size(); i++) {
+    const auto type = (*shared)[i].type;
+    if (type == EToken::{{separator}} || type == EToken::MY_EOF) {
+      pieces.emplace_back(begin, i);
+      begin = i + 1;
+    }
+    if (type == EToken::MY_EOF) {
+      break;
+    }
+  }
+
+  auto root = NewTree(actions);
+  root->name = "start";
+  std::vector<TPtr> items(pieces.size());
+  std::vector<std::exception_ptr> errors(pieces.size());
+  ParallelFor(pieces.size(), threads, makeVisitor, [&](const std::shared_ptr<IVisitor>& visitor, std::size_t i) {
+    auto lexer = std::make_shared<TTokenVectorLexer>(shared, pieces[i].first, pieces[i].second, input);
+    try {
+      TTokenVectorParser parser{lexer, visitor, actions};
+      if (i == 0 && PUSH_TABLE[{{item_index}}][static_cast<std::size_t>(lexer->Peek().type)] == PUSH_NO_RULE) {
+        // a sequential parse rejects it before it gets to {{item}}
+        parser.Unexpected("Parse_start");
+      }
+      items[i] = parser.Parse_{{item}}(root.get());
+      if (!lexer->AtEnd()) {
+        // where a sequential parse finds the token after an item
+        parser.Unexpected("Parse_start");
+      }
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  for (std::size_t i = 0; i < pieces.size(); i++) {
+    if (errors[i]) {
+      std::rethrow_exception(errors[i]);  // the one a sequential parse would hit
+    }
+    root->AddChild(items[i]);
+    if (i + 1 < pieces.size()) {
+      auto separator = std::make_shared<TLeaf>();
+      separator->name = (*shared)[pieces[i].second].text;
+      root->AddChild(separator);
+    }
+  }
+  return root;
+}
+)";
+
+const char* MAIN_TEMPLATE = R"(
+#include "parser.hh"
+#include "ast.hh"
+{{namespace_begin}}
+struct TVisitor : IVisitor {
+  // TODO: write the implementation of visit methods if there are any (they are
+  // all abstract
+  using T = int;
+
+  T GetT(const TNode* n) {
+    try {
+      return std::any_cast<T>(n->value);
+    } catch (...) {
+      std::cerr << "Caught in TNode* with name " << n->name << std::endl;
+      throw;
+    }
+  }
+
+  T GetT(const std::shared_ptr<TNode>& n) {
+    return GetT(n.get());
+  }
+
+  bool IsEps(const TNode* n) {
+    if (n == nullptr) {
+      return true;  // elided by --elide_eps
+    }
+    auto t = dynamic_cast<const TTree*>(n);
+    if (t == nullptr) {
+      return false;
+    }
+    return t->children.empty();
+  }
+
+  {{visit_overrides}}
+};
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  // TODO: tweak this function to your liking
+  return std::make_shared<TVisitor>();
+}
+{{namespace_end}}
+int main(int argc, char** argv) {
+  return {{namespace_prefix}}RunDriver(argc, argv);
 }
 )";
@@ -1,5 +1,9 @@
+#include <filesystem>
+
+#include <absl/strings/str_join.h>
 #include <absl/strings/str_split.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/substitute.h>
 
 #include <range/v3/view/zip.hpp>
@@ -7,6 +11,15 @@
 #include <gtest/gtest.h>
 
 #include "common.hh"
+#include "dfa.hh"
+
+// generated from tests/<name>/grammar, see CMakeLists.txt
+#include "sum/parser.hh"
+#include "split/parser.hh"
+#include "words/parser.hh"
+#include "spans/parser.hh"
+#include "chains/parser.hh"
+#include "elided/parser.hh"
 
 TEST(GENERATOR_TEST, SANITY_CHECK) {
   EXPECT_EQ(0, 0);
@@ -480,3 +493,1232 @@ INSTANTIATE_TEST_SUITE_P(GrammarProcessing, GrammarTest, testing::Values<TParam>
       TParam{SAMPLE8, GRAMMAR8, false}
       // TODO: add more examples, I'm too lazy to do it now
 ));
+
+TEST(GENERATOR_TEST, TAIL_RECURSION) {
+  auto grammar3 = ParseGrammar(SAMPLE3);
+  EXPECT_TRUE(grammar3->IsTailRecursive("e_prime"));
+  EXPECT_TRUE(grammar3->IsTailRecursive("t_prime"));
+  EXPECT_FALSE(grammar3->IsTailRecursive("e"));
+  EXPECT_FALSE(grammar3->IsTailRecursive("f"));
+  EXPECT_FALSE(grammar3->IsTailRecursive("start"));
+
+  auto grammar6 = ParseGrammar(SAMPLE6);
+  EXPECT_TRUE(grammar6->IsTailRecursive("l_prime"));
+  EXPECT_FALSE(grammar6->IsTailRecursive("s"));
+
+  // left recursion doesn't count
+  auto grammar2 = ParseGrammar(SAMPLE2);
+  EXPECT_FALSE(grammar2->IsTailRecursive("e"));
+
+  // translation symbols may follow the recursive call
+  auto withActions = ParseGrammar(R"(
+PLUS    [+]
+%%
+start: e_prime;
+e_prime: PLUS $before e_prime $after | EPS;
+)");
+  EXPECT_TRUE(withActions->IsTailRecursive("e_prime"));
+}
+
+TEST(GENERATOR_TEST, EBNF) {
+  auto grammar = ParseGrammar(R"(
+COMMA    ,
+VARIABLE    [a-z]+
+PLUS    [+]
+MINUS    [-]
+%%
+start: args;
+args: (VARIABLE (COMMA VARIABLE)*)?;
+sum: VARIABLE ( (PLUS | MINUS) VARIABLE $op )+;
+)");
+  using TRules = std::vector<std::vector<std::string>>;
+  EXPECT_EQ((TRules{{"args__opt2"}}), grammar->rules["args"]);
+  EXPECT_EQ((TRules{{"VARIABLE", "args__star1"}, {"EPS"}}), grammar->rules["args__opt2"]);
+  EXPECT_EQ((TRules{{"COMMA", "VARIABLE", "args__star1"}, {"EPS"}}), grammar->rules["args__star1"]);
+  EXPECT_EQ((TRules{{"VARIABLE", "sum__plus5"}}), grammar->rules["sum"]);
+  EXPECT_EQ((TRules{{"PLUS"}, {"MINUS"}}), grammar->rules["sum__group3"]);
+  EXPECT_EQ((TRules{{"sum__group3", "VARIABLE", "$op", "sum__star4"}}), grammar->rules["sum__plus5"]);
+  EXPECT_EQ((TRules{{"sum__group3", "VARIABLE", "$op", "sum__star4"}, {"EPS"}}), grammar->rules["sum__star4"]);
+
+  EXPECT_EQ(ESynthetic::Optional, grammar->synthetic["args__opt2"].kind);
+  EXPECT_EQ(ESynthetic::Star, grammar->synthetic["args__star1"].kind);
+  EXPECT_EQ(ESynthetic::Group, grammar->synthetic["sum__plus5"].kind);
+  EXPECT_EQ("sum", grammar->synthetic["sum__group3"].owner);
+  EXPECT_EQ(5, grammar->synthetic.size());
+
+  grammar->CalculateFIRST();
+  grammar->CalculateFOLLOW();
+  EXPECT_TRUE(grammar->IsLL1());
+
+  EXPECT_ANY_THROW(ParseGrammar("A    a\n%%\nstart: (A;"));
+  EXPECT_ANY_THROW(ParseGrammar("A    a\n%%\nstart: A);"));
+  EXPECT_ANY_THROW(ParseGrammar("A    a\n%%\nstart: * A;"));
+  EXPECT_ANY_THROW(ParseGrammar("A    a\n%%\nstart: ( | A);"));
+}
+
+TEST(GENERATOR_TEST, INLINING) {
+  auto grammar = ParseGrammar(R"(
+LPAREN    [(]
+RPAREN    [)]
+VARIABLE    [a-z]+
+COMMA    ,
+%%
+start: call;
+call: name LPAREN args RPAREN;
+name: VARIABLE;
+args: ( arg ( COMMA arg )* )?;
+arg: VARIABLE | call;
+)");
+  // name and args are small, arg is in a cycle with call which is used twice
+  EXPECT_EQ((std::unordered_set<std::string>{"name", "args"}), grammar->FindInlinable(1));
+  // with a bigger limit call is inlined too, so arg can't be
+  EXPECT_EQ((std::unordered_set<std::string>{"name", "args", "call"}), grammar->FindInlinable(10));
+
+  auto withActions = ParseGrammar(R"(
+NUM    [0-9]+
+PLUS    [+]
+%%
+start: e $start;
+e: t e_prime;
+e_prime: PLUS t $add e_prime | EPS;
+t: NUM;
+)");
+  // start has actions (so e can't be inlined), e refers to e_prime which
+  // has actions, and t is used by e_prime
+  EXPECT_TRUE(withActions->FindInlinable(10).empty());
+}
+
+TEST(GENERATOR_TEST, WHITESPACE_IN_TOKENS) {
+  for (auto regex : {"[0-9]+", "[a-z_][a-z0-9_]*", "lambda", "!!", "[(]", "\\+", "[[:alpha:]]+", "[]a]", "[-+]"}) {
+    EXPECT_FALSE(CanMatchWhitespace(regex)) << regex;
+  }
+  for (auto regex : {"a b", ".+", "[^a]", "\\s", "\\W", "[ -~]+", "[[:space:]]", "[[:print:]]", "\\x20", "a\\tb"}) {
+    EXPECT_TRUE(CanMatchWhitespace(regex)) << regex;
+  }
+}
+
+TEST(GENERATOR_TEST, SPLIT) {
+  constexpr std::string_view TOKENS = R"(
+NUM    [0-9]+
+PLUS    [+]
+SEMI    ;
+LPAREN    [(]
+RPAREN    [)]
+%%
+)";
+  auto grammar = ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+start: e ( SEMI e )*;
+e: NUM ( PLUS NUM )*;
+)"));
+  ASSERT_TRUE(grammar->split.has_value());
+  EXPECT_EQ("e", grammar->split->item);
+  EXPECT_EQ("SEMI", grammar->split->separator);
+
+  // the separator is reachable from the item
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+start: e ( SEMI e )*;
+e: NUM | LPAREN start RPAREN;
+)")), std::runtime_error);
+  // start isn't a separated list
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+start: e ( SEMI e )* SEMI;
+e: NUM;
+)")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split PLUS;
+start: e ( SEMI e )*;
+e: NUM;
+)")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%split COMMA;\nstart: NUM;\n")), std::runtime_error);
+  // the items are parsed apart before start has children, so their actions
+  // have to say what they read
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+start: e ( SEMI e )*;
+e: NUM $num;
+)")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+%depends $num parent;
+start: e ( SEMI e )*;
+e: NUM $num;
+)")), std::runtime_error);
+  EXPECT_NO_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%split SEMI;
+%depends $num;
+%depends $sum t;
+start: e ( SEMI e )*;
+e: t ( PLUS t )* $sum;
+t: NUM $num;
+)")));
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%bogus;\nstart: NUM;\n")), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, PURE) {
+  constexpr std::string_view TOKENS = R"(
+NUM    [0-9]+
+PLUS    [+]
+%%
+)";
+  auto grammar = ParseGrammar(absl::StrCat(TOKENS, R"(
+%pure $start $sum $num;
+start: e $start;
+e: t ( PLUS t )* $sum;
+t: NUM $num;
+)"));
+  EXPECT_EQ((std::unordered_set<std::string>{"$start", "$sum", "$num"}), grammar->pure);
+
+  // not the last symbol
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $num;\nstart: NUM $num PLUS;\n")), std::runtime_error);
+  // inside a group, so it would run on the owner's node in the middle of it
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $add;\nstart: NUM ( PLUS NUM $add )*;\n")), std::runtime_error);
+  // unused or not a translation symbol
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $nope;\nstart: NUM;\n")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure NUM;\nstart: NUM;\n")), std::runtime_error);
+
+  // $start reads the value of e, which may only be set after the parse
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $sum $num;\nstart: e $start;\ne: t ( PLUS t )* $sum;\nt: NUM $num;\n")), std::runtime_error);
+  // the same through a group, inside or after it
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $num;\nstart: t ( PLUS t $add )*;\nt: NUM $num;\n")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $num;\nstart: t ( PLUS NUM $add )*;\nt: NUM $num;\n")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $num;\nstart: NUM ( PLUS t )* $sum;\nt: NUM $num;\n")), std::runtime_error);
+  // actions before it, or that %depends on something else, don't read it
+  EXPECT_NO_THROW(ParseGrammar(absl::StrCat(TOKENS, "%pure $num;\nstart: NUM $first PLUS t;\nt: NUM $num;\n")));
+  EXPECT_NO_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%pure $num;
+%depends $first;
+%depends $last;
+%depends $num;
+start: NUM $first PLUS t $last;
+t: NUM $num;
+)")));
+}
+
+TEST(GENERATOR_TEST, DEPENDS) {
+  constexpr std::string_view TOKENS = R"(
+NUM    [0-9]+
+PLUS    [+]
+%%
+)";
+  auto grammar = ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $start e;
+%depends $e_before t;
+%depends $e_after e_prime;
+%depends $plus parent t;
+%depends $t;
+start: e $start;
+e: t $e_before e_prime $e_after;
+e_prime: PLUS t $plus e_prime | EPS;
+t: NUM $t;
+)"));
+  EXPECT_EQ((std::vector<std::string>{"parent", "t"}), grammar->depends.at("$plus"));
+  EXPECT_TRUE(grammar->depends.at("$t").empty());
+  // dependencies are resolved to children: counted from the first one, or
+  // back from the action when a group comes before them
+  auto index = DependencyIndex(*grammar, "$e_after", "e_prime");
+  EXPECT_FALSE(index.fromAction);
+  EXPECT_EQ(1, index.offset);
+  auto repeated = ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $set t;
+start: ( PLUS t $set )*;
+t: NUM;
+)"));
+  index = DependencyIndex(*repeated, "$set", "t");
+  EXPECT_TRUE(index.fromAction);
+  EXPECT_EQ(1, index.offset);
+  // groups before and after t, so it is neither
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $set t;
+start: ( PLUS )* t ( PLUS )* $set;
+t: NUM;
+)")), std::runtime_error);
+
+  // e_after reads e_prime before it is parsed
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $e_after e_prime;
+%depends $t;
+start: e;
+e: t $e_after e_prime;
+e_prime: PLUS t e_prime | EPS;
+t: NUM $t;
+)")), std::runtime_error);
+  // $plus reads the value of e, but nothing sets it before e_prime
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $plus parent t;
+%depends $t;
+start: e;
+e: t e_prime;
+e_prime: PLUS t $plus e_prime | EPS;
+t: NUM $t;
+)")), std::runtime_error);
+  // an action inside the group sets it before the repetition goes on
+  EXPECT_NO_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $add parent;
+%depends $set t;
+start: e;
+e: t ( PLUS $set x )*;
+x: NUM $add;
+t: NUM;
+)")));
+  // ...and finds t at the same index in every repetition
+  index = DependencyIndex(*ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $add parent;
+%depends $set t;
+start: e;
+e: t ( PLUS $set x )*;
+x: NUM $add;
+t: NUM;
+)")), "$set", "t");
+  EXPECT_FALSE(index.fromAction);
+  EXPECT_EQ(0, index.offset);
+  // every symbol needs %depends
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%depends $a;\nstart: NUM $a $b;\n")), std::runtime_error);
+  // start has no parent
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%depends $a parent;\nstart: NUM $a;\n")), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, BATCH) {
+  constexpr std::string_view TOKENS = R"(
+NUM    [0-9]+
+PLUS    [+]
+%%
+)";
+  auto grammar = ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $start t;
+%depends $t;
+%batch $t;
+start: t ( PLUS t )* $start;
+t: NUM $t;
+)"));
+  EXPECT_TRUE(grammar->batch.contains("$t"));
+
+  // batched actions depend on nothing
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $start t;
+%batch $start;
+start: t $start;
+t: NUM;
+)")), std::runtime_error);
+  // and no action of their node comes before them
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, R"(
+%depends $a;
+%depends $b;
+%batch $b;
+start: NUM $a PLUS $b;
+)")), std::runtime_error);
+  // %batch needs %depends
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%batch $a;\nstart: NUM $a;\n")), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, TOKEN_VALUE) {
+  constexpr std::string_view TOKENS = R"(
+NUM    [0-9]+
+REAL    [0-9]+[.][0-9]+
+WORD    [a-z]+
+%%
+)";
+  auto grammar = ParseGrammar(absl::StrCat(TOKENS, R"(
+%value NUM int64;
+%value REAL float;
+%value WORD intern;
+start: NUM REAL WORD;
+)"));
+  EXPECT_EQ("std::int64_t", grammar->tokenValue.at("NUM"));
+  EXPECT_EQ("double", grammar->tokenValue.at("REAL"));
+  EXPECT_EQ("TSymbol", grammar->tokenValue.at("WORD"));
+
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%value NAME int;\nstart: NUM;\n")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%value NUM decimal;\nstart: NUM;\n")), std::runtime_error);
+  EXPECT_THROW(ParseGrammar(absl::StrCat(TOKENS, "%value NUM int;\n%value NUM float;\nstart: NUM;\n")), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, KEYWORDS) {
+  EXPECT_EQ("lambda", RegexLiteral("lambda"));
+  EXPECT_EQ("(", RegexLiteral("[(]"));
+  EXPECT_EQ("+=", RegexLiteral("\\+="));
+  EXPECT_EQ(std::nullopt, RegexLiteral("[a-z]+"));
+  EXPECT_EQ(std::nullopt, RegexLiteral("if|else"));
+  EXPECT_EQ(std::nullopt, RegexLiteral("\\d"));
+
+  auto grammar = ParseGrammar(R"(
+LAMBDA    lambda
+IF    if
+LPAREN    [(]
+VARIABLE    [a-z]+
+%%
+start: LAMBDA IF LPAREN VARIABLE;
+)");
+  EXPECT_EQ((std::unordered_map<std::string, std::string>{{"LAMBDA", "lambda"}, {"IF", "if"}}), grammar->keywords);
+
+  // an alternation may stop short of the keyword
+  grammar = ParseGrammar(R"(
+IF    if
+WORD    i|[a-z]+
+%%
+start: IF WORD;
+)");
+  EXPECT_TRUE(grammar->keywords.empty());
+
+  // a full match, but on "aab..." the lexer stops after "aa"
+  grammar = ParseGrammar(R"(
+KW    aab
+WORD    a*(ab)?
+%%
+start: KW WORD;
+)");
+  EXPECT_TRUE(grammar->keywords.empty());
+
+  // a lazy quantifier or a lookahead
+  grammar = ParseGrammar(R"(
+KW    abc
+LAZY    [a-z]+?
+AHEAD    [a-z]+(?=!)
+%%
+start: KW LAZY AHEAD;
+)");
+  EXPECT_TRUE(grammar->keywords.empty());
+
+  // an alternation that gets there anyway
+  grammar = ParseGrammar(R"(
+KW    for
+WORD    [a-z]+|[0-9]+
+%%
+start: KW WORD;
+)");
+  EXPECT_EQ((std::unordered_map<std::string, std::string>{{"KW", "for"}}), grammar->keywords);
+
+  const std::vector<std::string> words{"lambda", "if", "else", "while", "for", "return", "let", "in"};
+  const auto hash = BuildKeywordHash(words);
+  std::unordered_set<std::size_t> slots;
+  for (const auto& word : words) {
+    slots.insert(KeywordHash(word, hash.seed) & (hash.slotCount - 1));
+  }
+  EXPECT_EQ(words.size(), slots.size());
+}
+
+TEST(GENERATOR_TEST, CHAR_CLASS_RUN) {
+  using TRanges = std::vector<std::pair<char, char>>;
+  EXPECT_EQ((TRanges{{'a', 'z'}}), CharClassRun("[a-z]+"));
+  EXPECT_EQ((TRanges{{'a', 'z'}, {'A', 'Z'}, {'_', '_'}}), CharClassRun("[a-zA-Z_]+"));
+  EXPECT_EQ(std::nullopt, CharClassRun("[a-z]*"));
+  EXPECT_EQ(std::nullopt, CharClassRun("[^a-z]+"));
+  EXPECT_EQ(std::nullopt, CharClassRun("[a-z][0-9]+"));
+  EXPECT_EQ(std::nullopt, CharClassRun("[[:alpha:]]+"));
+  EXPECT_EQ(std::nullopt, CharClassRun("[abcde]+"));
+}
+
+TEST(GENERATOR_TEST, DFA) {
+  const std::vector<std::string> regexes{"lambda", "[a-z]+", "[0-9]+", "[0-9]+[.][0-9]*(e[+-]?[0-9]{1,3})?", "[(]", "ab|abc", "\\+\\+?", "x{2,}"};
+  const auto subsets = BuildDfa(regexes);
+  const auto dfa = MergeByteClasses(MinimizeDfa(subsets));
+  EXPECT_LE(dfa.next.size(), subsets.next.size());
+  EXPECT_LT(dfa.classCount, 20);
+
+  // the longest match, the first regex in case of a tie
+  auto expected = [&](std::string_view text) {
+    std::pair<std::size_t, std::int32_t> result{0, DFA_NO_TOKEN};
+    for (std::size_t n = 1; n <= text.size(); n++) {
+      for (std::size_t k = 0; k < regexes.size(); k++) {
+        if (std::regex_match(text.begin(), text.begin() + n, std::regex{regexes[k]})) {
+          result = {n, static_cast<std::int32_t>(k)};
+          break;
+        }
+      }
+    }
+    return result;
+  };
+  const auto comb = PackComb(dfa);
+  auto matchComb = [&](std::string_view text) {
+    std::pair<std::size_t, std::int32_t> result{0, DFA_NO_TOKEN};
+    std::int32_t state = dfa.start;
+    for (std::size_t i = 0; i < text.size(); i++) {
+      const auto at = comb.base[state] + dfa.classOf[static_cast<unsigned char>(text[i])];
+      if (comb.check[at] != state) {
+        break;
+      }
+      state = comb.next[at];
+      if (dfa.accept[state] != DFA_NO_TOKEN) {
+        result = {i + 1, dfa.accept[state]};
+      }
+    }
+    return result;
+  };
+  for (std::string_view text : {"lambda", "lambdas", "lamb", "123", "12.5e+10x", "12.e", "(", "abc", "abd", "++", "+", "xxxx", "x", "", "?"}) {
+    EXPECT_EQ(expected(text), MatchLongest(dfa, text)) << text;
+    EXPECT_EQ(expected(text), MatchLongest(subsets, text)) << text;
+    EXPECT_EQ(expected(text), matchComb(text)) << text;
+  }
+
+  EXPECT_THROW(BuildDfa({"^a"}), std::runtime_error);
+  EXPECT_THROW(BuildDfa({"a+?"}), std::runtime_error);
+  EXPECT_THROW(BuildDfa({"(a"}), std::runtime_error);
+  EXPECT_THROW(BuildDfa({"[a-"}), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, UTF8_DFA) {
+  const auto dfa = MergeByteClasses(MinimizeDfa(BuildDfa({"[а-яё]+", "é+", "\\u{1F600}|\\u20AC", "[^a-z ]", "."}, true)));
+  auto match = [&](std::string_view text) { return MatchLongest(dfa, text); };
+  EXPECT_EQ(match("привет мир"), std::pair(std::size_t{12}, 0));
+  EXPECT_EQ(match("ёж"), std::pair(std::size_t{4}, 0));
+  EXPECT_EQ(match("ééx"), std::pair(std::size_t{4}, 1));  // `+` repeats the code point, not the last byte
+  EXPECT_EQ(match("€"), std::pair(std::size_t{3}, 2));
+  EXPECT_EQ(match("😀"), std::pair(std::size_t{4}, 2));
+  EXPECT_EQ(match("Ж"), std::pair(std::size_t{2}, 3));
+  EXPECT_EQ(match("\xF4\x8F\xBF\xBF"), std::pair(std::size_t{4}, 3));  // U+10FFFF
+  EXPECT_EQ(match("a"), std::pair(std::size_t{1}, 4));
+  // neither a surrogate nor a stray continuation byte is a character
+  EXPECT_EQ(match("\xED\xA0\x80"), std::pair(std::size_t{0}, DFA_NO_TOKEN));
+  EXPECT_EQ(match("\x80"), std::pair(std::size_t{0}, DFA_NO_TOKEN));
+  // the same classes over bytes
+  EXPECT_EQ(MatchLongest(BuildDfa({"[^a-z ]"}), "Ж"), std::pair(std::size_t{1}, 0));
+  EXPECT_THROW(BuildDfa({"\\u20AC"}), std::runtime_error);
+  EXPECT_THROW(BuildDfa({"[я-а]"}, true), std::runtime_error);
+}
+
+TEST(GENERATOR_TEST, DFA_WHITESPACE) {
+  auto inside = [](std::string regex) { return CanMatchInside(MinimizeDfa(BuildDfa({regex})), " \t\n"); };
+  for (auto regex : {"[a-z]+", "[^a]", "\\s?x", "[^a-z]x", "(\\s|a)"}) {
+    EXPECT_FALSE(inside(regex)) << regex;
+  }
+  for (auto regex : {"\"[^\"]*\"", "a b", "x\\s+", "\\s*x", ".+", "[^a]+", "a(\\n|b)*c"}) {
+    EXPECT_TRUE(inside(regex)) << regex;
+  }
+}
+
+
+/******************************************************************************
+*                              Generated parsers                              *
+******************************************************************************/
+
+namespace sum {
+
+// The value of a node is the sum of the numbers under it, a NAME counts its
+// letters
+struct TSumVisitor : IVisitor {
+  static int Value(const TPtr& node) {
+    return node == nullptr || !node->value.has_value() ? 0 : std::any_cast<int>(node->value);
+  }
+
+  void visit_start(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]);
+  }
+
+  void visit_e(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]) + Value(ctx->children[1]);
+  }
+
+  void visit_plus(TTree* ctx) override {
+    ctx->value = Value(ctx->children[1]) + Value(ctx->children[2]);
+  }
+
+  void visit_num(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]);
+  }
+
+  void visit_name(TTree* ctx) override {
+    ctx->value = static_cast<int>(ctx->children[0]->name.size() / 2);  // Greek letters take 2 bytes
+  }
+
+  void visit_paren(TTree* ctx) override {
+    ctx->value = Value(ctx->children[1]);
+  }
+};
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<TSumVisitor>();
+}
+
+std::shared_ptr<TLexer> MakeLexer(std::string input) {
+  return std::make_shared<TLexer>(std::make_shared<std::istringstream>(std::move(input)));
+}
+
+std::string ToDot(const TNode* root) {
+  std::ostringstream out;
+  TreeToDot(out, root);
+  return out.str();
+}
+
+// The tree or the error message of a parse
+std::string Outcome(const std::function<TPtr()>& parse) {
+  try {
+    return ToDot(parse().get());
+  } catch (const std::runtime_error& e) {
+    return e.what();
+  }
+}
+
+// Feeds the input to a push parser (TPushParser or TCoParser) in chunks of
+// every size that cuts its Greek letters and numbers, and compares the trees
+// with a pulled parse
+template <class TPush>
+void ExpectChunked(const std::string& input) {
+  auto expected = TParser{MakeLexer(input)}.Parse();
+  for (std::size_t chunk : {1, 2, 3, 5, 7, 64}) {
+    TPush parser;
+    for (std::size_t i = 0; i < input.size(); i += chunk) {
+      EXPECT_EQ(EPushStatus::NeedInput, parser.Feed(std::string_view{input}.substr(i, chunk))) << chunk;
+    }
+    auto tree = parser.Finish();
+    ASSERT_NE(nullptr, tree) << chunk;
+    EXPECT_EQ(ToDot(expected.get()), ToDot(tree.get())) << chunk;
+    EXPECT_EQ(std::any_cast<int>(expected->value), std::any_cast<int>(tree->value)) << chunk;
+  }
+}
+
+}  // namespace sum
+
+namespace split {
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<IVisitor>();
+}
+
+std::string ToDot(const TNode* root) {
+  std::ostringstream out;
+  TreeToDot(out, root);
+  return out.str();
+}
+
+// The tree or the error message of a parse
+std::string Outcome(const std::function<TPtr()>& parse) {
+  try {
+    return ToDot(parse().get());
+  } catch (const std::runtime_error& e) {
+    return e.what();
+  }
+}
+
+}  // namespace split
+
+namespace words {
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<IVisitor>();
+}
+
+std::shared_ptr<TLexer> MakeLexer(std::string input, std::shared_ptr<TSymbolTable> symbols = std::make_shared<TSymbolTable>()) {
+  return std::make_shared<TLexer>(std::make_shared<std::istringstream>(std::move(input)), std::move(symbols));
+}
+
+// The leaves of the tree, in order
+std::vector<const TNode*> Leaves(const TNode* root) {
+  std::vector<const TNode*> leaves;
+  std::vector<const TNode*> stack{root};
+  while (!stack.empty()) {
+    const auto node = stack.back();
+    stack.pop_back();
+    if (auto tree = dynamic_cast<const TTree*>(node); tree != nullptr) {
+      for (auto it = tree->children.rbegin(); it != tree->children.rend(); ++it) {
+        stack.push_back(it->get());
+      }
+    } else if (node != nullptr) {
+      leaves.push_back(node);
+    }
+  }
+  return leaves;
+}
+
+}  // namespace words
+
+namespace spans {
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<IVisitor>();
+}
+
+}  // namespace spans
+
+// The sum visitor over the chains grammar, for its parsers with and without
+// --elide_eps and --collapse_chains
+template <class IVisitor, class TTree, class TPtr>
+struct TChainsVisitor : IVisitor {
+  // a t: atom node carries no value itself, its atom child does, unless the
+  // chain is collapsed and the atom takes its place
+  static int Value(const TPtr& node) {
+    if (node == nullptr) {
+      return 0;
+    }
+    if (node->value.has_value()) {
+      return std::any_cast<int>(node->value);
+    }
+    auto tree = dynamic_cast<const TTree*>(node.get());
+    return tree != nullptr && tree->children.size() == 1 ? Value(tree->children[0]) : 0;
+  }
+
+  void visit_start(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]);
+  }
+
+  void visit_e(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]) + Value(ctx->children[1]);
+  }
+
+  void visit_plus(TTree* ctx) override {
+    ctx->value = Value(ctx->children[1]) + Value(ctx->children[2]);
+  }
+
+  void visit_num(TTree* ctx) override {
+    ctx->value = Value(ctx->children[0]);
+  }
+
+  void visit_name(TTree* ctx) override {
+    ctx->value = static_cast<int>(ctx->children[0]->name.size());
+  }
+
+  void visit_paren(TTree* ctx) override {
+    ctx->value = Value(ctx->children[1]);
+  }
+};
+
+namespace chains {
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<TChainsVisitor<IVisitor, TTree, TPtr>>();
+}
+
+}  // namespace chains
+
+namespace elided {
+
+std::shared_ptr<IVisitor> GetVisitor() {
+  return std::make_shared<TChainsVisitor<IVisitor, TTree, TPtr>>();
+}
+
+}  // namespace elided
+
+// The names of the nodes in pre-order, "-" for elided ones
+template <class TTree, class TNode>
+std::vector<std::string> Names(const TNode* root) {
+  std::vector<std::string> names;
+  std::vector<const TNode*> stack{root};
+  while (!stack.empty()) {
+    const auto node = stack.back();
+    stack.pop_back();
+    names.push_back(node != nullptr ? node->name : "-");
+    if (auto tree = dynamic_cast<const TTree*>(node); tree != nullptr) {
+      for (auto it = tree->children.rbegin(); it != tree->children.rend(); ++it) {
+        stack.push_back(it->get());
+      }
+    }
+  }
+  return names;
+}
+
+TEST(PARSER_TEST, LONG_INPUT) {
+  // e_prime is parsed by a tail loop into a chain of 100000 nodes: nothing
+  // may recurse along it
+  constexpr int TERMS = 100000;
+  std::string input = "1";
+  for (int i = 1; i < TERMS; i++) {
+    input += "+1";
+  }
+  for (auto actions : {sum::EActions::Eager, sum::EActions::DeferPure, sum::EActions::Lazy}) {
+    auto visitor = sum::GetVisitor();
+    auto tree = sum::TParser{sum::MakeLexer(input), visitor, actions}.Parse();
+    if (actions == sum::EActions::DeferPure) {
+      sum::EvaluatePure(tree.get(), 2);
+    } else if (actions == sum::EActions::Lazy) {
+      sum::Demand(*visitor, static_cast<sum::TTree*>(tree.get()));
+    }
+    EXPECT_EQ(TERMS, std::any_cast<int>(tree->value));
+    const auto dot = sum::ToDot(tree.get());
+    EXPECT_EQ(std::count(dot.begin(), dot.end(), '>'), std::count(dot.begin(), dot.end(), '[') - 1);
+  }
+}
+
+// name(children...) for nodes with children, the name for leaves
+template <class TView>
+std::string Shape(TView node) {
+  std::string shape{node.Name()};
+  if (node.IsLeaf()) {
+    return shape;
+  }
+  shape += "(";
+  for (std::size_t i = 0; i < node.ChildCount(); i++) {
+    shape += (i == 0 ? "" : ",") + (node.Child(i).IsNull() ? std::string{"-"} : Shape(node.Child(i)));
+  }
+  return shape + ")";
+}
+
+TEST(PARSER_TEST, MAPPED_TREE) {
+  const auto path = ::testing::TempDir() + "/mapped_tree.bin";
+  auto write = [&](const std::string& bytes) {
+    std::ofstream{path, std::ios::binary} << bytes;
+  };
+  auto tree = sum::TParser{sum::MakeLexer("1 + (αβ + 2) + 3")}.Parse();
+  std::ostringstream binary;
+  sum::TreeToBinary(binary, tree.get());
+  write(binary.str());
+  {
+    sum::TMappedTree mapped{path};
+    std::ostringstream dot;
+    sum::TreeToDot(dot, mapped.Root());
+    EXPECT_EQ(sum::ToDot(tree.get()), dot.str());
+    EXPECT_EQ("start", mapped.Root().Name());
+    EXPECT_EQ("e", mapped.Root().Child(0).Name());
+    // code templated on the view walks either tree the same way
+    EXPECT_EQ(Shape(sum::TTreeView{tree.get()}), Shape(mapped.Root()));
+    EXPECT_EQ("start(e(t(1),e_prime(+,t((,e(t(αβ),e_prime(+,t(2),e_prime())),)),e_prime(+,t(3),e_prime()))))", Shape(mapped.Root()));
+  }
+
+  // node #i is at this offset, see TPackedNode
+  auto node = [](std::size_t i) { return sizeof(sum::TPackedHeader) + i * sizeof(sum::TPackedNode); };
+  auto corrupt = [&](std::size_t at, std::uint32_t value) {
+    auto bytes = binary.str();
+    std::memcpy(bytes.data() + at, &value, sizeof(value));
+    write(bytes);
+  };
+  // a name past the pool
+  corrupt(node(1) + offsetof(sum::TPackedNode, nameSize), 1 << 20);
+  EXPECT_THROW(sum::TMappedTree{path}, std::runtime_error);
+  corrupt(node(1) + offsetof(sum::TPackedNode, nameOffset), UINT32_MAX);
+  EXPECT_THROW(sum::TMappedTree{path}, std::runtime_error);
+  // the root as its own child
+  corrupt(node(0) + offsetof(sum::TPackedNode, firstChild), 0);
+  EXPECT_THROW(sum::TMappedTree{path}, std::runtime_error);
+  // children past the last node
+  corrupt(node(0) + offsetof(sum::TPackedNode, childCount), 1 << 20);
+  EXPECT_THROW(sum::TMappedTree{path}, std::runtime_error);
+  std::remove(path.c_str());
+}
+
+TEST(PARSER_TEST, PARSE_CACHE) {
+  const auto dir = ::testing::TempDir() + "/parse_cache";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  const std::string input = "1 + αβγ";
+  {
+    sum::TParseCache cache{dir, 0, sum::GetVisitor(), sum::TrivialValueCodec<int>()};
+    auto miss = cache.Parse(input);
+    ASSERT_NE(nullptr, miss.tree);
+    EXPECT_EQ(4, std::any_cast<int>(miss.value));
+    auto hit = cache.Parse(input);
+    EXPECT_EQ(miss.tree, hit.tree);
+    EXPECT_EQ(4, std::any_cast<int>(hit.value));
+    EXPECT_EQ(1u, cache.Stats().hits);
+    EXPECT_EQ(1u, cache.Stats().misses);
+  }
+  {
+    // another run finds the tree and the value of its root on disk
+    sum::TParseCache cache{dir, 0, sum::GetVisitor(), sum::TrivialValueCodec<int>()};
+    auto hit = cache.Parse(input);
+    ASSERT_NE(nullptr, hit.mapped);
+    EXPECT_EQ(4, std::any_cast<int>(hit.value));
+    EXPECT_EQ(1u, cache.Stats().diskHits);
+    std::ostringstream dot;
+    sum::TreeToDot(dot, hit.mapped->Root());
+    EXPECT_EQ(sum::ToDot(sum::TParser{sum::MakeLexer(input)}.Parse().get()), dot.str());
+  }
+  // without a codec the tree isn't stored, rather than found without its value
+  sum::TParseCache{dir}.Parse("2 + 2");
+  sum::TParseCache cache{dir};
+  auto again = cache.Parse("2 + 2");
+  EXPECT_EQ(nullptr, again.mapped);
+  EXPECT_EQ(4, std::any_cast<int>(again.value));
+  EXPECT_EQ(1u, cache.Stats().misses);
+  std::filesystem::remove_all(dir);
+
+  // trees of another grammar never pass for these
+  EXPECT_NE(sum::GRAMMAR_FINGERPRINT, words::GRAMMAR_FINGERPRINT);
+}
+
+TEST(PARSER_TEST, PURE) {
+  const std::string input = "1 + (2 + αβ) + ((3))";
+  auto eager = sum::TParser{sum::MakeLexer(input)}.Parse();
+  EXPECT_EQ(8, std::any_cast<int>(eager->value));
+  for (unsigned threads : {1, 4}) {
+    // every action is %pure, so none of them runs during the parse
+    auto tree = sum::TParser{sum::MakeLexer(input), sum::GetVisitor(), sum::EActions::DeferPure}.Parse();
+    EXPECT_FALSE(tree->value.has_value());
+    sum::EvaluatePure(tree.get(), threads);
+    EXPECT_EQ(8, std::any_cast<int>(tree->value)) << threads;
+  }
+}
+
+TEST(PARSER_TEST, BATCH) {
+  struct TBatchVisitor : sum::TSumVisitor {
+    void visit_num_batch(const std::vector<sum::TTree*>& nodes) override {
+      batches.push_back(nodes.size());
+      TSumVisitor::visit_num_batch(nodes);
+    }
+
+    std::vector<std::size_t> batches;
+  };
+  const std::string input = "1 + (2 + 3) + αβ + 4";
+  for (auto actions : {sum::EActions::Eager, sum::EActions::DeferPure, sum::EActions::Lazy}) {
+    auto visitor = std::make_shared<TBatchVisitor>();
+    auto tree = sum::TParser{sum::MakeLexer(input), visitor, actions}.Parse();
+    if (actions == sum::EActions::DeferPure) {
+      sum::EvaluatePure(tree.get(), 1);
+    } else if (actions == sum::EActions::Lazy) {
+      sum::RunBatches(*visitor, tree.get());
+      sum::Demand(*visitor, static_cast<sum::TTree*>(tree.get()));
+    }
+    EXPECT_EQ(12, std::any_cast<int>(tree->value));
+    // only a lazy parse leaves the actions for RunBatches
+    EXPECT_EQ(actions == sum::EActions::Lazy ? std::vector<std::size_t>{4} : std::vector<std::size_t>{}, visitor->batches);
+  }
+}
+
+TEST(PARSER_TEST, ELIDED) {
+  // the same actions give the same values with and without the nodes
+  for (std::string input : {"1", "1 + (2 + ab) + ((3))", "(((x)))", "1 + 2 + 3 + 4"}) {
+    auto plain = chains::TParser{std::make_shared<chains::TLexer>(std::make_shared<std::istringstream>(input))}.Parse();
+    auto elided = elided::TParser{std::make_shared<elided::TLexer>(std::make_shared<std::istringstream>(input))}.Parse();
+    EXPECT_EQ(std::any_cast<int>(plain->value), std::any_cast<int>(elided->value)) << input;
+  }
+
+  // but the trees differ: t is collapsed into its atom, the EPS e_prime is gone
+  auto plain = chains::TParser{std::make_shared<chains::TLexer>(std::make_shared<std::istringstream>("1"))}.Parse();
+  auto elided = elided::TParser{std::make_shared<elided::TLexer>(std::make_shared<std::istringstream>("1"))}.Parse();
+  EXPECT_EQ(1, std::any_cast<int>(plain->value));
+  EXPECT_EQ((std::vector<std::string>{"start", "e", "t", "atom", "1", "e_prime"}), Names<chains::TTree>(plain.get()));
+  EXPECT_EQ((std::vector<std::string>{"start", "e", "atom", "1", "-"}), Names<elided::TTree>(elided.get()));
+}
+
+TEST(PARSER_TEST, PUSH) {
+  // chunks of 1 and 3 bytes cut every Greek letter (2 bytes in UTF-8) and
+  // the numbers, larger ones cut some of them
+  sum::ExpectChunked<sum::TPushParser>("12 + αβγ + (345 + ωω) + 6789");
+  sum::TPushParser parser;
+  parser.Feed("1 + \xCE");  // half of α
+  EXPECT_THROW(parser.Finish(), std::runtime_error);
+
+  // the DFA goes on from where the last chunk left it: a long token fed a
+  // byte at a time costs no more than fed at once
+  sum::TPushParser letters;
+  std::string name;
+  for (int i = 0; i < 50000; i++) {
+    name += "α";
+  }
+  for (char c : name) {
+    EXPECT_EQ(sum::EPushStatus::NeedInput, letters.Feed(std::string_view{&c, 1}));
+  }
+  ASSERT_NE(nullptr, letters.Finish());
+  EXPECT_EQ(50000, std::any_cast<int>(letters.Result()->value));
+
+  // without the DFA, whitespace decides a token, since none can contain it:
+  // words are lexed and interned as soon as a space follows them
+  auto symbols = std::make_shared<words::TSymbolTable>();
+  words::TPushParser wordsParser{words::GetVisitor(), words::EActions::Eager, symbols};
+  EXPECT_EQ(words::EPushStatus::NeedInput, wordsParser.Feed("x ya"));
+  EXPECT_EQ(1u, symbols->Size());
+  EXPECT_EQ(words::EPushStatus::NeedInput, wordsParser.Feed("b\nlet"));
+  EXPECT_EQ(2u, symbols->Size());
+  EXPECT_EQ("yab", symbols->Name({1}));
+  EXPECT_EQ(words::EPushStatus::NeedInput, wordsParser.Feed("x = 1 "));
+  EXPECT_EQ(3u, symbols->Size());
+  EXPECT_EQ("letx", symbols->Name({2}));
+  auto words = wordsParser.Finish();
+  ASSERT_NE(nullptr, words);
+  auto pulled = words::TParser{words::MakeLexer("x yab\nletx = 1 ")}.Parse();
+  EXPECT_EQ(words::Leaves(pulled.get()).size(), words::Leaves(words.get()).size());
+}
+
+TEST(PARSER_TEST, PIPELINED) {
+  // TLexer validates UTF-8 as it fills its buffer, so invalid bytes past the
+  // first 64 KiB fail the parse only after the tokens up to about 32 KiB
+  // before them: a syntax error there comes first
+  auto terms = [](std::string input, std::size_t size) {
+    while (input.size() < size) {
+      input += " + 1";
+    }
+    return input;
+  };
+  const std::string invalid = " \xCE";
+  for (std::string input : std::vector<std::string>{
+      "12 + αβγ + (345 + ωω) + 6789",
+      "1 + + 2",
+      "1 + 2" + invalid,
+      terms("1", 1000),
+      terms("1", 70000) + invalid,
+      terms(terms("1", 32500) + " + + 1", 70000) + invalid,
+      terms(terms("1", 100) + " + + 1", 70000) + invalid,
+      terms(terms("1", 40000) + " + + 1", 70000) + invalid,
+  }) {
+    auto sequential = sum::Outcome([&] {
+      return sum::TParser{sum::MakeLexer(input)}.Parse();
+    });
+    auto pipelined = sum::Outcome([&] {
+      return sum::TPipelinedParser{std::make_shared<sum::TPipelinedLexer>(std::make_shared<std::istringstream>(input)), sum::GetVisitor()}.Parse();
+    });
+    EXPECT_EQ(sequential, pipelined) << input.substr(0, 100);
+  }
+}
+
+TEST(PARSER_TEST, INLINED) {
+  // pair, key and value are parsed right into start, spans record where
+  auto tree = spans::TParser{std::make_shared<spans::TLexer>(std::make_shared<std::istringstream>("a = 1; b = c;"))}.Parse();
+  EXPECT_EQ((std::vector<std::string>{"start", "a", "=", "1", ";", "b", "=", "c", ";"}), Names<spans::TTree>(tree.get()));
+  spans::ExpandInlined(tree.get());
+  EXPECT_EQ((std::vector<std::string>{
+      "start",
+      "pair", "key", "a", "=", "value", "1", ";",
+      "pair", "key", "b", "=", "value", "c", ";"}), Names<spans::TTree>(tree.get()));
+  const auto& root = static_cast<const spans::TTree&>(*tree);
+  for (std::uint32_t i = 0; i < root.children.size(); i++) {
+    EXPECT_EQ(tree.get(), root.children[i]->parent);
+    EXPECT_EQ(i, root.children[i]->index);
+  }
+}
+
+TEST(PARSER_TEST, SCAN_CLASS) {
+  // every length around the vector widths, stopped at every byte or at the
+  // end, agrees with the scalar scan
+  const words::TCharClass cls{2, {{'a', 'z'}, {'0', '9'}}};
+  for (std::size_t length = 0; length <= 70; length++) {
+    for (std::size_t stop = 0; stop <= length; stop++) {
+      std::string text(length, 'q');
+      for (std::size_t i = 0; i < length; i++) {
+        text[i] = "a9z0m"[i % 5];
+      }
+      if (stop < length) {
+        text[stop] = stop % 2 == 0 ? ' ' : '\xCE';  // also past the signed range
+      }
+      const char* begin = text.data();
+      const char* end = begin + text.size();
+      const auto expected = words::ScanClassScalar(cls, begin, end) - begin;
+      EXPECT_EQ(static_cast<std::ptrdiff_t>(stop), expected);
+      EXPECT_EQ(expected, words::ScanClass(cls, begin, end) - begin) << length << " " << stop;
+#if defined(__x86_64__) || defined(__i386__)
+      EXPECT_EQ(expected, words::ScanClassSse2(cls, begin, end) - begin) << length << " " << stop;
+      if (__builtin_cpu_supports("avx2")) {
+        EXPECT_EQ(expected, words::ScanClassAvx2(cls, begin, end) - begin) << length << " " << stop;
+      }
+#endif
+    }
+  }
+
+  // the words lexer matches NAME and NUM with MatchClass and EQ with
+  // MatchLiteral; names of every length around the vector widths, and ones
+  // longer than half the buffer, come out whole
+  std::vector<std::string> texts;
+  std::string input;
+  for (std::size_t length : {1, 15, 16, 17, 31, 32, 33, 47, 64, 65, 40000, 100000, 200000}) {
+    texts.push_back(std::string(length, 'x'));
+    texts.push_back("=");
+    texts.push_back("12");
+  }
+  for (const auto& text : texts) {
+    input += text + " ";
+  }
+  auto lexer = words::MakeLexer(input);
+  for (const auto& text : texts) {
+    EXPECT_EQ(text, lexer->Peek().text);
+    EXPECT_EQ(text == "=" ? words::EToken::EQ : text[0] == 'x' ? words::EToken::NAME : words::EToken::NUM, lexer->Peek().type);
+    lexer->NextToken();
+  }
+  EXPECT_EQ(words::EToken::MY_EOF, lexer->Peek().type);
+  EXPECT_TRUE(lexer->ReachedEnd());
+
+  // the DFA lexer reads on the same way
+  std::string name;
+  for (int i = 0; i < 50000; i++) {
+    name += "α";
+  }
+  auto dfaLexer = sum::MakeLexer(name + " + 1");
+  EXPECT_EQ(name, dfaLexer->Peek().text);
+  dfaLexer->NextToken();
+  EXPECT_EQ(sum::EToken::PLUS, dfaLexer->Peek().type);
+}
+
+TEST(PARSER_TEST, KEYWORDS) {
+  // the words lexer has no DFA: NAME matches the keywords too, and only the
+  // ones it matches in full are looked up as keywords
+  auto lexer = words::MakeLexer("lambda lambdax let letx in inx xin lamb l = 1");
+  std::vector<words::EToken> types;
+  for (; lexer->Peek().type != words::EToken::MY_EOF; lexer->NextToken()) {
+    types.push_back(lexer->Peek().type);
+  }
+  using words::EToken;
+  EXPECT_EQ((std::vector<EToken>{
+      EToken::LAMBDA, EToken::NAME, EToken::LET, EToken::NAME, EToken::IN, EToken::NAME,
+      EToken::NAME, EToken::NAME, EToken::NAME, EToken::EQ, EToken::NUM}), types);
+}
+
+TEST(PARSER_TEST, INTERN) {
+  auto symbols = std::make_shared<words::TSymbolTable>();
+  auto tree = words::TParser{words::MakeLexer("x lambdax 1 x y lambdax", symbols)}.Parse();
+  std::vector<std::uint32_t> ids;
+  for (const auto leaf : words::Leaves(tree.get())) {
+    if (auto symbol = std::any_cast<words::TSymbol>(&leaf->value); symbol != nullptr) {
+      EXPECT_TRUE(leaf->name.empty());
+      ids.push_back(symbol->id);
+    }
+  }
+  EXPECT_EQ((std::vector<std::uint32_t>{0, 1, 0, 2, 1}), ids);
+  EXPECT_EQ(3u, symbols->Size());
+  EXPECT_EQ("lambdax", symbols->Name({1}));
+  std::ostringstream dot;
+  words::TreeToDot(dot, tree.get(), words::SymbolNames(symbols));
+  EXPECT_NE(std::string::npos, dot.str().find("[label=\"lambdax\"]")) << dot.str();
+
+  // a batch shares one table, on any number of threads
+  const std::vector<std::string> inputs{"a b", "b c", "c a", "let a = 1"};
+  for (unsigned threads : {1, 4}) {
+    auto batchSymbols = std::make_shared<words::TSymbolTable>(true);
+    std::vector<std::string> names;
+    for (const auto& result : words::ParseAll(inputs, threads, words::GetVisitor, batchSymbols)) {
+      ASSERT_NE(nullptr, result.tree) << result.error;
+      for (const auto leaf : words::Leaves(result.tree.get())) {
+        if (auto symbol = std::any_cast<words::TSymbol>(&leaf->value); symbol != nullptr) {
+          names.emplace_back(batchSymbols->Name(*symbol));
+        }
+      }
+    }
+    EXPECT_EQ((std::vector<std::string>{"a", "b", "b", "c", "c", "a", "a"}), names) << threads;
+    EXPECT_EQ(3u, batchSymbols->Size()) << threads;
+  }
+}
+
+TEST(PARSER_TEST, RECOVER) {
+  sum::TParser parser{sum::MakeLexer("1 + + 2 + (3 4) + (5 +")};
+  parser.OnError(sum::EOnError::Recover);
+  auto tree = parser.Parse();
+  ASSERT_NE(nullptr, tree);
+  std::vector<std::string> messages;
+  for (const auto& diagnostic : parser.Diagnostics()) {
+    messages.push_back(diagnostic.message);
+  }
+  ASSERT_EQ(4u, messages.size()) << absl::StrJoin(messages, "\n");
+  EXPECT_NE(std::string::npos, messages[0].find("Unexpected + at Parse_t")) << messages[0];
+  EXPECT_NE(std::string::npos, messages[1].find("Unexpected 4 at Parse_e_prime")) << messages[1];
+  EXPECT_NE(std::string::npos, messages[2].find("Unexpected end of input at Parse_t")) << messages[2];
+  EXPECT_NE(std::string::npos, messages[3].find("Expected RPAREN but got end of input")) << messages[3];
+  // nothing starts or follows start, so it skips everything up to the end
+  parser.Parse(std::make_shared<std::istringstream>(")) + ))"));
+  EXPECT_EQ(1u, parser.Diagnostics().size());
+
+  // after the error no action is left for later either, $start of the root
+  // is not recorded
+  sum::TParser lazy{sum::MakeLexer("1 + + 2"), sum::GetVisitor(), sum::EActions::Lazy};
+  lazy.OnError(sum::EOnError::Recover);
+  auto partial = lazy.Parse();
+  ASSERT_NE(nullptr, partial);
+  EXPECT_TRUE(static_cast<sum::TLazyTree*>(partial.get())->pending.empty());
+
+  // only parsers generated with --recover can
+  words::TParser words{words::MakeLexer("x")};
+  EXPECT_THROW(words.OnError(words::EOnError::Recover), std::runtime_error);
+  words.OnError(words::EOnError::Return);
+}
+
+TEST(PARSER_TEST, POSITIONS) {
+  // longer than the lexer's buffer, so the earlier lines are dropped before
+  // the later errors are met
+  constexpr int LINES = 20000;
+  std::string input;
+  std::string valid;
+  for (int i = 1; i <= LINES; i++) {
+    input += i == 3 || i == 15000 ? "+ 1 +\n" : "1 +\n";
+    valid += "1 +\n";
+  }
+  input += "1";
+  sum::TParser parser{sum::MakeLexer(input)};
+  parser.OnError(sum::EOnError::Recover);
+  parser.Parse();
+  ASSERT_EQ(2u, parser.Diagnostics().size());
+  EXPECT_NE(std::string::npos, parser.Diagnostics()[0].message.find("(line 3, column 1)")) << parser.Diagnostics()[0].message;
+  EXPECT_NE(std::string::npos, parser.Diagnostics()[1].message.find("(line 15000, column 1)")) << parser.Diagnostics()[1].message;
+  try {
+    sum::TParser{sum::MakeLexer(valid + "1 + )")}.Parse();
+    FAIL();
+  } catch (const std::runtime_error& e) {
+    EXPECT_NE(std::string::npos, std::string{e.what()}.find("(line 20001, column 5)")) << e.what();
+  }
+}
+
+TEST(PARSER_TEST, RETURN) {
+  sum::TParser parser{sum::MakeLexer("1 + (2")};
+  parser.OnError(sum::EOnError::Return);
+  EXPECT_EQ(nullptr, parser.Parse());
+  ASSERT_EQ(1u, parser.Diagnostics().size());
+  const auto& message = parser.Diagnostics().front().message;
+  EXPECT_NE(std::string::npos, message.find("Expected RPAREN but got end of input")) << message;
+  // the stop is reset by the next parse
+  EXPECT_NE(nullptr, parser.Parse(std::make_shared<std::istringstream>("1 + (2)")));
+  EXPECT_TRUE(parser.Diagnostics().empty());
+  parser.Parse(std::make_shared<std::istringstream>("1 + + 2 + + 3"));
+  ASSERT_EQ(1u, parser.Diagnostics().size());
+  EXPECT_NE(std::string::npos, parser.Diagnostics().front().message.find("Unexpected + at Parse_t"));
+}
+
+TEST(PARSER_TEST, PARSE_ALL) {
+  // a syntax error and a lexer error in the middle fail only their own
+  // inputs, with the message a sequential Parse() throws
+  std::vector<std::string> inputs;
+  for (int i = 0; i < 20; i++) {
+    inputs.push_back(std::to_string(i) + " + (αβ + " + std::to_string(i * 7) + ")");
+  }
+  inputs[9] = "1 + + 2";
+  inputs[12] = "2 + \xCE";
+  std::vector<std::string> expected;
+  std::vector<int> values;
+  for (const auto& input : inputs) {
+    expected.push_back(sum::Outcome([&] {
+      auto tree = sum::TParser{sum::MakeLexer(input)}.Parse();
+      values.push_back(std::any_cast<int>(tree->value));
+      return tree;
+    }));
+  }
+  ASSERT_EQ(inputs.size() - 2, values.size());
+  auto check = [&](const sum::TBatchResult& result, const std::string& where) {
+    EXPECT_EQ(expected[result.index], result.tree != nullptr ? sum::ToDot(result.tree.get()) : result.error) << where;
+    EXPECT_EQ(result.tree == nullptr, result.index == 9 || result.index == 12) << where;
+  };
+
+  for (unsigned threads : {1, 2, 4, 8}) {
+    const auto results = sum::ParseAll(inputs, threads);
+    ASSERT_EQ(inputs.size(), results.size());
+    std::size_t valid = 0;
+    for (std::size_t i = 0; i < results.size(); i++) {
+      EXPECT_EQ(i, results[i].index);
+      check(results[i], std::to_string(threads) + " threads, input " + std::to_string(i));
+      if (results[i].tree != nullptr) {
+        EXPECT_EQ(values[valid++], std::any_cast<int>(results[i].tree->value));
+      }
+    }
+  }
+
+  std::string lines;
+  for (const auto& input : inputs) {
+    lines += input + "\n";
+  }
+  std::istringstream in{lines};
+  std::size_t next = 0;
+  auto summary = sum::ParseBatch(in, sum::EBatchFormat::Lines, [&](const sum::TBatchResult& result) {
+    EXPECT_EQ(next++, result.index);
+    check(result, "ParseBatch, input " + std::to_string(result.index));
+  });
+  EXPECT_EQ(inputs.size(), next);
+  EXPECT_EQ(inputs.size() - 2, summary.ok);
+  EXPECT_EQ(2u, summary.failed);
+}
+
+TEST(PARSER_TEST, SPLIT) {
+  // the errors at the ends of the items are the ones a parse of the whole
+  // input meets there, at the same tokens
+  for (std::string input : {"1; 2 + (3 + 4); 5", "1", "1 2; 3", "1 ); 2", "1;;2", "1;", "; 1", "(1; 2)", "1 + (2; 3)", "1 + ; 2", "1; 2 3 4"}) {
+    auto sequential = split::Outcome([&] {
+      return split::TParser{std::make_shared<split::TLexer>(std::make_shared<std::istringstream>(input))}.Parse();
+    });
+    for (unsigned threads : {1, 4}) {
+      auto parallel = split::Outcome([&] {
+        return split::ParseTokens(split::LexParallel(input, threads, 1), threads, split::GetVisitor, split::EActions::Eager, input);
+      });
+      EXPECT_EQ(sequential, parallel) << input << " on " << threads << " threads";
+    }
+  }
+}
+
+#if defined(__cpp_impl_coroutine)
+TEST(PARSER_TEST, CO_PARSER) {
+  sum::ExpectChunked<sum::TCoParser>("12 + αβγ + (345 + ωω) + 6789");
+  sum::TCoParser parser;
+  parser.Feed("1 + (2");
+  EXPECT_THROW(parser.Finish(), std::runtime_error);
+}
+#endif